@@ -0,0 +1,108 @@
+/***********************************************************************/
+/**                                                                    */
+/** actuator_model.hpp                                                 */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _ACTUATOR_MODEL_HPP_
+#define _ACTUATOR_MODEL_HPP_
+
+#include <cmath>
+#include <algorithm>
+
+namespace utils
+{
+
+/**
+ * Model of a position-controlled actuator that moves toward its target at a constant velocity
+ *
+ * It predicts the position between measurements, every measurement resets the prediction.
+ */
+class ActuatorModel
+{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param velocity the velocity of the actuator in units per second
+	 * @param tolerance distance to the target considered as reached
+	 */
+	ActuatorModel(double velocity = 1.0, double tolerance = 0.5)
+	: velocity(velocity), tolerance(tolerance), position(0), target(0), time(0), valid(false) {}
+	/**
+	 * Set the velocity in units per second
+	 */
+	void setVelocity(double velocity) {ActuatorModel::velocity = std::abs(velocity);}
+	/**
+	 * Set the commanded target position
+	 */
+	void setTarget(double target) {ActuatorModel::target = target;}
+	/**
+	 * Correct the prediction with a measurement
+	 *
+	 * @param measurement the measured position
+	 * @param time the time of the measurement in seconds
+	 */
+	void correct(double measurement, double time)
+	{
+		if (!valid) {
+			target = measurement;
+			valid = true;
+		}
+		position = measurement;
+		ActuatorModel::time = time;
+	}
+	/**
+	 * Predict the position at a given time
+	 *
+	 * @param time the time in seconds, not older than the last measurement
+	 * @return the predicted position
+	 */
+	double predict(double time) const
+	{
+		double step = velocity * std::max(0.0, time - ActuatorModel::time);
+		if (std::abs(target - position) <= step) {
+			return target;
+		}
+		return target > position ? position + step : position - step;
+	}
+	/**
+	 * Is the actuator moving at a given time?
+	 */
+	bool isMoving(double time) const {return valid && std::abs(target - predict(time)) > tolerance;}
+	/**
+	 * Has the actuator been measured?
+	 */
+	bool isValid() const {return valid;}
+
+private:
+	double velocity;
+	double tolerance;
+	double position; // Last measured position
+	double target;
+	double time; // Time of the last measurement
+	bool valid;
+};
+
+}
+
+#endif
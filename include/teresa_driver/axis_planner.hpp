@@ -0,0 +1,164 @@
+/***********************************************************************/
+/**                                                                    */
+/** axis_planner.hpp                                                   */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+
+#ifndef _AXIS_PLANNER_HPP_
+#define _AXIS_PLANNER_HPP_
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+namespace utils
+{
+
+/**
+ * Planner of the position commands of a position-controlled axis
+ *
+ * It merges jog commands (move toward a limit, stop where it is) and
+ * position references, and it gives the position command to send only when
+ * it changes. With a maximum rate, the command moves toward the goal at that
+ * rate, starting from the position estimate.
+ */
+class AxisPlanner
+{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param min_position the lower limit
+	 * @param max_position the upper limit
+	 * @param max_rate maximum rate of the command in units per second, 0 for no limit
+	 */
+	AxisPlanner(double min_position = 0, double max_position = 0, double max_rate = 0)
+	: min_position(min_position), max_position(max_position), max_rate(max_rate),
+	  goal(0), setpoint(0), setpoint_time(0), has_goal(false), stop_pending(false), restart(false),
+	  last_command(std::numeric_limits<int>::min()) {}
+	/**
+	 * Set the limits of the axis
+	 */
+	void setLimits(double min_position, double max_position)
+	{
+		AxisPlanner::min_position = min_position;
+		AxisPlanner::max_position = max_position;
+	}
+	/**
+	 * Set the maximum rate of the command in units per second, 0 for no limit
+	 */
+	void setMaxRate(double max_rate) {AxisPlanner::max_rate = std::abs(max_rate);}
+	/**
+	 * Jog the axis
+	 *
+	 * @param direction 1 to move to the upper limit, -1 to the lower one, 0 to stop where it is
+	 */
+	void jog(int direction);
+	/**
+	 * Move to a position, it is saturated to the limits
+	 */
+	void setReference(double position);
+	/**
+	 * Plan the command of the current cycle
+	 *
+	 * @param estimate the estimated position of the axis
+	 * @param time the current time in seconds
+	 * @param command[OUT] the position command to send
+	 * @return true if the command should be sent, false if it is already sent
+	 */
+	bool update(double estimate, double time, int& command);
+	/**
+	 * The last command could not be sent, it is planned again in the next cycle
+	 */
+	void retry() {last_command = std::numeric_limits<int>::min();}
+
+private:
+	double min_position;
+	double max_position;
+	double max_rate;
+	double goal;
+	double setpoint; // Rate-limited command
+	double setpoint_time;
+	bool has_goal;
+	bool stop_pending; // Stop at the estimate in the next update
+	bool restart; // Start the setpoint from the estimate in the next update
+	int last_command;
+};
+
+inline
+void AxisPlanner::jog(int direction)
+{
+	if (direction == 0) {
+		stop_pending = true;
+	} else {
+		goal = direction > 0 ? max_position : min_position;
+		has_goal = true;
+		stop_pending = false;
+		restart = true;
+	}
+}
+
+inline
+void AxisPlanner::setReference(double position)
+{
+	goal = std::min(std::max(position,min_position),max_position);
+	has_goal = true;
+	stop_pending = false;
+	restart = true;
+}
+
+inline
+bool AxisPlanner::update(double estimate, double time, int& command)
+{
+	if (stop_pending) {
+		goal = std::min(std::max(estimate,min_position),max_position);
+		has_goal = true;
+		stop_pending = false;
+		restart = true;
+	}
+	if (!has_goal) {
+		return false;
+	}
+	if (restart) {
+		setpoint = max_rate > 0 ? estimate : goal;
+		setpoint_time = time;
+		restart = false;
+	}
+	if (max_rate > 0) {
+		double step = max_rate * std::max(0.0, time - setpoint_time);
+		setpoint = goal > setpoint ? std::min(goal, setpoint + step) : std::max(goal, setpoint - step);
+	} else {
+		setpoint = goal;
+	}
+	setpoint_time = time;
+	command = (int)std::round(setpoint);
+	if (command == last_command) {
+		return false;
+	}
+	last_command = command;
+	return true;
+}
+
+}
+
+#endif
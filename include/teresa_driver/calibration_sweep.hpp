@@ -0,0 +1,425 @@
+/***********************************************************************/
+/**                                                                    */
+/** calibration_sweep.hpp                                              */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _CALIBRATION_SWEEP_HPP_
+#define _CALIBRATION_SWEEP_HPP_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "calibration_table.hpp"
+
+namespace utils
+{
+
+/**
+ * Configuration of a calibration sweep
+ */
+struct SweepConfig
+{
+	SweepConfig() : min_units(15), max_units(130), steps(8), settle_samples(10), settle_tolerance(0.01),
+			settle_timeout(5), sample_time(2), min_velocity(0.03) {}
+	int min_units; // Smallest magnitude of the motor units
+	int max_units; // Largest magnitude of the motor units
+	int steps; // Magnitudes from min_units to max_units, each one is run in both directions
+	int settle_samples; // Samples of the window to detect the steady state
+	double settle_tolerance; // Maximum standard deviation of the wheel velocities in the window, in m/s
+	double settle_timeout; // Seconds to reach the steady state, the step is discarded after it
+	double sample_time; // Seconds collecting samples in the steady state
+	double min_velocity; // Slower wheels (m/s) are in the dead zone and not used by the fit
+};
+
+/**
+ * A step of a calibration sweep
+ */
+struct SweepStep
+{
+	int16_t units[2]; // Motor units of the left and right wheels
+	double velocity[2]; // Mean wheel velocities in steady state (m/s)
+	double deviation[2]; // Standard deviation of the wheel velocities (m/s)
+	int samples; // Samples in steady state
+	double settle_time; // Seconds to reach the steady state, or until the timeout
+	bool settled; // Has the steady state been reached?
+};
+
+/**
+ * Sweep of the motor units of both wheels to calibrate them
+ *
+ * The wheels are driven in opposite directions (the robot rotates in place)
+ * through the configured magnitudes, first rotating to the left and then to
+ * the right, so each wheel is measured in both directions. In each step the
+ * velocities of the encoders are fed until they are steady, and then averaged
+ * for the sample time. The motor units are the ones of the calibration tables,
+ * before the inversion of the motors.
+ */
+class CalibrationSweep
+{
+public:
+	CalibrationSweep() : state(IDLE), current(0), step_start(0), sample_start(0), window_head(0), window_count(0) {}
+	/**
+	 * Start a sweep
+	 *
+	 * @param config the configuration
+	 * @param error[OUT] the error message if fail
+	 * @return true if success, false otherwise
+	 */
+	bool start(const SweepConfig& config, std::string& error);
+	/**
+	 * Abort the running sweep
+	 */
+	void abort();
+	/**
+	 * Is a sweep running?
+	 */
+	bool isRunning() const {return state==SETTLING || state==SAMPLING;}
+	/**
+	 * Has the last sweep finished every step?
+	 */
+	bool isDone() const {return state==DONE;}
+	/**
+	 * Has the last sweep been aborted?
+	 */
+	bool isAborted() const {return state==ABORTED;}
+	/**
+	 * Feed the wheel velocities of a cycle and get the motor units to command
+	 *
+	 * @param time the time of the velocities in seconds
+	 * @param left_velocity the velocity of the left wheel in m/s
+	 * @param right_velocity the velocity of the right wheel in m/s
+	 * @param left_units[OUT] the motor units of the left wheel
+	 * @param right_units[OUT] the motor units of the right wheel
+	 * @return true if the sweep is running, false otherwise (the units are 0)
+	 */
+	bool update(double time, double left_velocity, double right_velocity, int16_t& left_units, int16_t& right_units);
+	/**
+	 * The steps of the last sweep
+	 */
+	const std::vector<SweepStep>& getSteps() const {return steps;}
+	/**
+	 * Index of the running step
+	 */
+	int getCurrentStep() const {return current;}
+	/**
+	 * Fit |units| = A*|v| + B to the settled steps of a wheel
+	 *
+	 * The steps in the dead zone or with the wheel moving against the command are not used
+	 * @param wheel 0 for the left wheel, 1 for the right one
+	 * @param fit[OUT] the fit, slope is A and offset is B
+	 * @return true if success, false otherwise
+	 */
+	bool fit(int wheel, LineFit& fit) const;
+	/**
+	 * Calibration table of a wheel
+	 *
+	 * The table has the measured points out of the dead zone plus the fitted
+	 * units at +-zero_velocity. If the measured points are not monotonic, it
+	 * is the linear table sign(v)*(|v|*A + B) up to max_velocity.
+	 * @param wheel 0 for the left wheel, 1 for the right one
+	 * @param zero_velocity smaller velocities are considered zero (m/s)
+	 * @param max_velocity maximum velocity of the linear table (m/s)
+	 * @param table[OUT] the table
+	 * @param measured[OUT] true if the table has the measured points, false if it is linear
+	 * @return true if success, false otherwise
+	 */
+	bool getTable(int wheel, double zero_velocity, double max_velocity, CalibrationTable& table, bool& measured) const;
+	/**
+	 * Human readable report of the last sweep and the quality of the fits
+	 *
+	 * @param lines[OUT] the lines of the report
+	 */
+	void getReport(std::vector<std::string>& lines) const;
+
+private:
+	enum State {IDLE, SETTLING, SAMPLING, DONE, ABORTED};
+	bool isMoving(const SweepStep& step, int wheel) const;
+	void nextStep(double time);
+
+	SweepConfig config;
+	std::vector<SweepStep> steps;
+	State state;
+	int current;
+	double step_start;
+	double sample_start;
+	std::vector<double> window[2]; // Last velocities to detect the steady state
+	int window_head;
+	int window_count;
+	double sum[2];
+	double sum_squares[2];
+};
+
+inline
+bool CalibrationSweep::start(const SweepConfig& config, std::string& error)
+{
+	if (isRunning()) {
+		error = "a sweep is already running";
+		return false;
+	}
+	if (config.min_units<=0 || config.max_units<=config.min_units || config.max_units>32767 || config.steps<2) {
+		error = "the sweep needs 0 < min_units < max_units <= 32767 and two or more steps";
+		return false;
+	}
+	if (config.settle_samples<2 || config.settle_tolerance<=0 || config.settle_timeout<=0 ||
+		config.sample_time<=0 || config.min_velocity<0) {
+		error = "invalid steady state configuration";
+		return false;
+	}
+	CalibrationSweep::config = config;
+	steps.clear();
+	for (int direction=1;direction>=-1;direction-=2) {
+		for (int i=0;i<config.steps;i++) {
+			int16_t units = (int16_t)std::round(config.min_units +
+						(double)i*(config.max_units-config.min_units)/(config.steps-1));
+			SweepStep step;
+			step.units[0] = (int16_t)(-direction*units);
+			step.units[1] = (int16_t)(direction*units);
+			step.velocity[0] = step.velocity[1] = 0;
+			step.deviation[0] = step.deviation[1] = 0;
+			step.samples = 0;
+			step.settle_time = 0;
+			step.settled = false;
+			steps.push_back(step);
+		}
+	}
+	window[0].assign(config.settle_samples,0);
+	window[1].assign(config.settle_samples,0);
+	current = -1;
+	step_start = -1; // Set by the first update
+	nextStep(0);
+	return true;
+}
+
+inline
+void CalibrationSweep::abort()
+{
+	if (isRunning()) {
+		steps[current].settled = false; // The running step is incomplete
+		state = ABORTED;
+	}
+}
+
+inline
+bool CalibrationSweep::update(double time, double left_velocity, double right_velocity,
+				int16_t& left_units, int16_t& right_units)
+{
+	left_units = 0;
+	right_units = 0;
+	if (!isRunning()) {
+		return false;
+	}
+	if (step_start<0) {
+		step_start = time;
+	}
+	double velocity[2] = {left_velocity,right_velocity};
+	SweepStep& step = steps[current];
+	if (state==SETTLING) {
+		window[0][window_head] = left_velocity;
+		window[1][window_head] = right_velocity;
+		window_head = (window_head+1) % config.settle_samples;
+		window_count = std::min(window_count+1,config.settle_samples);
+		bool steady = window_count==config.settle_samples;
+		for (int i=0;i<2 && steady;i++) {
+			double mean=0,deviation=0;
+			for (int j=0;j<window_count;j++) {
+				mean += window[i][j];
+			}
+			mean /= window_count;
+			for (int j=0;j<window_count;j++) {
+				deviation += (window[i][j]-mean)*(window[i][j]-mean);
+			}
+			steady = std::sqrt(deviation/window_count) <= config.settle_tolerance;
+		}
+		if (steady) {
+			step.settled = true;
+			step.settle_time = time - step_start;
+			state = SAMPLING;
+			sample_start = time;
+			sum[0] = sum[1] = 0;
+			sum_squares[0] = sum_squares[1] = 0;
+		} else if (time - step_start >= config.settle_timeout) {
+			step.settle_time = time - step_start;
+			nextStep(time);
+		}
+	} else {
+		for (int i=0;i<2;i++) {
+			sum[i] += velocity[i];
+			sum_squares[i] += velocity[i]*velocity[i];
+		}
+		step.samples++;
+		if (time - sample_start >= config.sample_time) {
+			for (int i=0;i<2;i++) {
+				step.velocity[i] = sum[i]/step.samples;
+				step.deviation[i] = std::sqrt(std::max(0.0,sum_squares[i]/step.samples - step.velocity[i]*step.velocity[i]));
+			}
+			nextStep(time);
+		}
+	}
+	if (!isRunning()) {
+		return false;
+	}
+	left_units = steps[current].units[0];
+	right_units = steps[current].units[1];
+	return true;
+}
+
+inline
+void CalibrationSweep::nextStep(double time)
+{
+	current++;
+	if (current >= (int)steps.size()) {
+		state = DONE;
+		return;
+	}
+	state = SETTLING;
+	if (step_start>=0) {
+		step_start = time;
+	}
+	window_head = 0;
+	window_count = 0;
+}
+
+inline
+bool CalibrationSweep::isMoving(const SweepStep& step, int wheel) const
+{
+	return step.settled && std::abs(step.velocity[wheel]) >= config.min_velocity &&
+		(step.velocity[wheel] > 0) == (step.units[wheel] > 0);
+}
+
+inline
+bool CalibrationSweep::fit(int wheel, LineFit& fit) const
+{
+	std::vector<double> x,y;
+	for (unsigned i=0;i<steps.size() && (int)i<current;i++) {
+		if (isMoving(steps[i],wheel)) {
+			x.push_back(std::abs(steps[i].velocity[wheel]));
+			y.push_back(std::abs(steps[i].units[wheel]));
+		}
+	}
+	return fitLine(x,y,fit);
+}
+
+inline
+bool CalibrationSweep::getTable(int wheel, double zero_velocity, double max_velocity,
+				CalibrationTable& table, bool& measured) const
+{
+	LineFit line;
+	if (!fit(wheel,line)) {
+		return false;
+	}
+	std::vector<std::pair<double,double> > points;
+	points.push_back(std::make_pair(-zero_velocity,-(zero_velocity*line.slope + line.offset)));
+	points.push_back(std::make_pair(zero_velocity,zero_velocity*line.slope + line.offset));
+	for (unsigned i=0;i<steps.size() && (int)i<current;i++) {
+		if (isMoving(steps[i],wheel) && std::abs(steps[i].velocity[wheel]) > zero_velocity) {
+			points.push_back(std::make_pair(steps[i].velocity[wheel],(double)steps[i].units[wheel]));
+		}
+	}
+	std::sort(points.begin(),points.end());
+	std::vector<double> velocities,units;
+	for (unsigned i=0;i<points.size();i++) {
+		velocities.push_back(points[i].first);
+		units.push_back(points[i].second);
+	}
+	measured = table.setPoints(velocities,units);
+	if (measured) {
+		return true;
+	}
+	velocities.resize(4);
+	units.resize(4);
+	velocities[0] = -max_velocity; units[0] = -(max_velocity*line.slope + line.offset);
+	velocities[1] = -zero_velocity; units[1] = -(zero_velocity*line.slope + line.offset);
+	velocities[2] = zero_velocity; units[2] = zero_velocity*line.slope + line.offset;
+	velocities[3] = max_velocity; units[3] = max_velocity*line.slope + line.offset;
+	return table.setPoints(velocities,units);
+}
+
+inline
+void CalibrationSweep::getReport(std::vector<std::string>& lines) const
+{
+	static const char* names[2] = {"left","right"};
+	lines.clear();
+	std::ostringstream ss;
+	ss<<"Calibration sweep "<<(state==DONE ? "done" : state==ABORTED ? "aborted" : isRunning() ? "running" : "not run")
+		<<": "<<steps.size()<<" steps from "<<config.min_units<<" to "<<config.max_units<<" motor units";
+	if (isRunning()) {
+		ss<<", running step "<<current+1;
+	}
+	lines.push_back(ss.str());
+	ss.setf(std::ios::fixed);
+	for (unsigned i=0;i<steps.size() && (int)i<current;i++) {
+		const SweepStep& step = steps[i];
+		ss.str("");
+		ss.precision(3);
+		ss<<"step "<<i+1<<": units "<<step.units[0]<<" "<<step.units[1];
+		if (step.settled) {
+			ss<<", left "<<step.velocity[0]<<" +- "<<step.deviation[0]
+				<<" m/s, right "<<step.velocity[1]<<" +- "<<step.deviation[1]
+				<<" m/s, "<<step.samples<<" samples, settled in "<<step.settle_time<<" s";
+		} else {
+			ss<<", not settled after "<<step.settle_time<<" s";
+		}
+		lines.push_back(ss.str());
+	}
+	for (int wheel=0;wheel<2;wheel++) {
+		int settled=0,moving=0,reversed=0;
+		for (unsigned i=0;i<steps.size() && (int)i<current;i++) {
+			if (!steps[i].settled) {
+				continue;
+			}
+			settled++;
+			if (isMoving(steps[i],wheel)) {
+				moving++;
+			} else if (std::abs(steps[i].velocity[wheel]) >= config.min_velocity) {
+				reversed++;
+			}
+		}
+		LineFit line;
+		ss.str("");
+		ss<<names[wheel]<<" wheel: ";
+		if (fit(wheel,line)) {
+			ss.precision(3);
+			ss<<"A_"<<names[wheel]<<"="<<line.slope<<" B_"<<names[wheel]<<"="<<line.offset;
+			ss.precision(5);
+			ss<<" r2="<<line.r2;
+			ss.precision(2);
+			ss<<" rms="<<line.rms<<" units, max residual "<<line.max_residual<<" units, ";
+		} else {
+			ss<<"no fit, ";
+		}
+		ss<<moving<<" points of "<<settled<<" settled steps ("<<settled-moving-reversed
+			<<" in the dead zone, "<<reversed<<" against the command)";
+		lines.push_back(ss.str());
+		if (reversed>0) {
+			lines.push_back(std::string("the ")+names[wheel]+" wheel moves against the command, check inverse_"+
+					names[wheel]+"_motor");
+		}
+	}
+}
+
+}
+
+#endif
@@ -0,0 +1,332 @@
+/***********************************************************************/
+/**                                                                    */
+/** calibration_table.hpp                                              */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+
+#ifndef _CALIBRATION_TABLE_HPP_
+#define _CALIBRATION_TABLE_HPP_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+
+namespace utils
+{
+
+/**
+ * Piecewise-linear map from wheel velocity to motor units
+ *
+ * The velocity range is divided in equal bins that store their first segment,
+ * so a lookup is a bin index and a short scan, with no search. Out of the
+ * range, the first and last segments are extrapolated.
+ *
+ * An odd table only stores the positive velocities, and the negative ones are
+ * mirrored: units(-v) = -units(v). It leaves out the dead band around zero, so
+ * the units may jump there, as with sign(v)*(|v|*A + B).
+ */
+class CalibrationTable
+{
+public:
+	CalibrationTable() : inv_bin_width(0), odd(false) {}
+	/**
+	 * Set the points of the table
+	 *
+	 * @param velocities the velocities in m/s, in strictly increasing order (positive if odd)
+	 * @param units the motor units of each velocity, in non-decreasing order
+	 * @param odd true to mirror the points for the negative velocities
+	 * @return true if success, false otherwise
+	 */
+	bool setPoints(const std::vector<double>& velocities, const std::vector<double>& units, bool odd = false);
+	/**
+	 * Motor units of a velocity
+	 *
+	 * @precondition the table should not be empty
+	 */
+	double getUnits(double velocity) const;
+	/**
+	 * Velocity of some motor units (inverse lookup, by binary search)
+	 *
+	 * @precondition the table should not be empty
+	 */
+	double getVelocity(double units) const;
+	/**
+	 * Has the table no points?
+	 */
+	bool isEmpty() const {return velocities.empty();}
+	/**
+	 * Are the negative velocities mirrored from the stored points?
+	 */
+	bool isOdd() const {return odd;}
+	/**
+	 * Velocities of the points
+	 */
+	const std::vector<double>& getVelocities() const {return velocities;}
+	/**
+	 * Motor units of the points
+	 */
+	const std::vector<double>& getUnits() const {return units;}
+
+private:
+	static double interpolate(double x, double x0, double x1, double y0, double y1)
+	{
+		return x1 == x0 ? y0 : y0 + (y1 - y0) * (x - x0) / (x1 - x0);
+	}
+	double lookupUnits(double velocity) const; // In the stored points
+	double lookupVelocity(double units) const;
+	std::vector<double> velocities;
+	std::vector<double> units;
+	std::vector<int> bins; // First segment of each bin
+	double inv_bin_width;
+	bool odd;
+};
+
+inline
+bool CalibrationTable::setPoints(const std::vector<double>& velocities, const std::vector<double>& units, bool odd)
+{
+	if (velocities.size() < 2 || velocities.size() != units.size() || (odd && !(velocities[0] > 0))) {
+		return false;
+	}
+	for (unsigned i=1;i<velocities.size();i++) {
+		if (!(velocities[i] > velocities[i-1]) || !(units[i] >= units[i-1])) {
+			return false;
+		}
+	}
+	CalibrationTable::velocities = velocities;
+	CalibrationTable::units = units;
+	CalibrationTable::odd = odd;
+	int segments = (int)velocities.size()-1;
+	int size = 4*segments; // A few bins per segment keep the scan short for uneven points
+	inv_bin_width = size / (velocities.back() - velocities.front());
+	bins.resize(size);
+	int segment = 0;
+	for (int i=0;i<size;i++) {
+		double start = velocities.front() + i / inv_bin_width;
+		while (segment < segments-1 && start >= velocities[segment+1]) {
+			segment++;
+		}
+		bins[i] = segment;
+	}
+	return true;
+}
+
+inline
+double CalibrationTable::getUnits(double velocity) const
+{
+	return odd && velocity < 0 ? -lookupUnits(-velocity) : lookupUnits(velocity);
+}
+
+inline
+double CalibrationTable::getVelocity(double units) const
+{
+	if (!odd) {
+		return lookupVelocity(units);
+	}
+	double velocity = std::max(lookupVelocity(std::abs(units)),0.0); // The dead band does not reverse
+	return units < 0 ? -velocity : velocity;
+}
+
+inline
+double CalibrationTable::lookupUnits(double velocity) const
+{
+	int bin = (int)((velocity - velocities.front()) * inv_bin_width);
+	int last = (int)velocities.size()-2; // Last segment
+	int segment;
+	if (bin < 0) {
+		segment = 0;
+	} else if (bin >= (int)bins.size()) {
+		segment = last;
+	} else {
+		segment = bins[bin];
+		while (segment < last && velocity > velocities[segment+1]) {
+			segment++;
+		}
+	}
+	return interpolate(velocity,velocities[segment],velocities[segment+1],units[segment],units[segment+1]);
+}
+
+inline
+double CalibrationTable::lookupVelocity(double units) const
+{
+	int last = (int)velocities.size()-2;
+	int segment = (int)(std::upper_bound(CalibrationTable::units.begin(),CalibrationTable::units.end(),units) -
+				CalibrationTable::units.begin()) - 1;
+	segment = std::min(std::max(segment,0),last);
+	return interpolate(units,CalibrationTable::units[segment],CalibrationTable::units[segment+1],
+				velocities[segment],velocities[segment+1]);
+}
+
+/**
+ * Least squares fit of a line y = slope*x + offset
+ */
+struct LineFit
+{
+	LineFit() : slope(0), offset(0), r2(0), rms(0), max_residual(0), samples(0) {}
+	double slope;
+	double offset;
+	double r2; // Coefficient of determination
+	double rms; // Root mean square of the residuals
+	double max_residual; // Largest absolute residual
+	int samples; // Number of points
+};
+
+/**
+ * Fit a line to some points by least squares
+ *
+ * @param x the abscissas
+ * @param y the ordinates
+ * @param fit[OUT] the line and the quality of the fit
+ * @return true if success, false otherwise (less than two different abscissas)
+ */
+inline
+bool fitLine(const std::vector<double>& x, const std::vector<double>& y, LineFit& fit)
+{
+	fit = LineFit();
+	int n = (int)std::min(x.size(),y.size());
+	if (n<2) {
+		return false;
+	}
+	double mx=0,my=0;
+	for (int i=0;i<n;i++) {
+		mx += x[i];
+		my += y[i];
+	}
+	mx /= n;
+	my /= n;
+	double sxx=0,sxy=0,syy=0;
+	for (int i=0;i<n;i++) {
+		sxx += (x[i]-mx)*(x[i]-mx);
+		sxy += (x[i]-mx)*(y[i]-my);
+		syy += (y[i]-my)*(y[i]-my);
+	}
+	if (sxx<=0) {
+		return false;
+	}
+	fit.slope = sxy/sxx;
+	fit.offset = my - fit.slope*mx;
+	fit.samples = n;
+	double sse=0;
+	for (int i=0;i<n;i++) {
+		double residual = y[i] - (fit.slope*x[i] + fit.offset);
+		sse += residual*residual;
+		fit.max_residual = std::max(fit.max_residual,std::abs(residual));
+	}
+	fit.rms = std::sqrt(sse/n);
+	fit.r2 = syy>0 ? 1 - sse/syy : 1;
+	return true;
+}
+
+/**
+ * Load the calibration tables of both wheels from a file
+ *
+ * Each line is "left <velocity> <units>" or "right <velocity> <units>", the
+ * lines starting with # are comments. The points can be in any order.
+ * @param file the file name
+ * @param left[OUT] the table of the left wheel
+ * @param right[OUT] the table of the right wheel
+ * @param error[OUT] the error message if fail
+ * @return true if success, false otherwise
+ */
+inline
+bool loadWheelCalibration(const std::string& file, CalibrationTable& left, CalibrationTable& right, std::string& error)
+{
+	std::ifstream in(file.c_str());
+	if (!in) {
+		error = "cannot open "+file;
+		return false;
+	}
+	std::vector<std::pair<double,double> > points[2];
+	std::string line;
+	int number = 0;
+	while (std::getline(in,line)) {
+		number++;
+		std::istringstream ss(line);
+		std::string wheel;
+		double velocity,units;
+		if (!(ss >> wheel) || wheel[0]=='#') {
+			continue;
+		}
+		if ((wheel!="left" && wheel!="right") || !(ss >> velocity >> units)) {
+			std::ostringstream message;
+			message<<file<<":"<<number<<": invalid calibration point";
+			error = message.str();
+			return false;
+		}
+		points[wheel=="left" ? 0 : 1].push_back(std::make_pair(velocity,units));
+	}
+	CalibrationTable* tables[2] = {&left,&right};
+	for (int i=0;i<2;i++) {
+		std::sort(points[i].begin(),points[i].end());
+		std::vector<double> velocities,units;
+		for (unsigned j=0;j<points[i].size();j++) {
+			velocities.push_back(points[i][j].first);
+			units.push_back(points[i][j].second);
+		}
+		if (!tables[i]->setPoints(velocities,units)) {
+			error = file+": the "+(i==0 ? "left" : "right")+
+				" table needs two or more points with different velocities and increasing units";
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Save the calibration tables of both wheels to a file (see loadWheelCalibration())
+ *
+ * @param file the file name
+ * @param left the table of the left wheel
+ * @param right the table of the right wheel
+ * @param header comment lines written at the beginning, without the #
+ * @return true if success, false otherwise
+ */
+inline
+bool saveWheelCalibration(const std::string& file, const CalibrationTable& left, const CalibrationTable& right,
+				const std::vector<std::string>& header = std::vector<std::string>())
+{
+	std::ofstream out(file.c_str());
+	out.precision(9);
+	for (unsigned i=0;i<header.size();i++) {
+		out<<"# "<<header[i]<<"\n";
+	}
+	const CalibrationTable* tables[2] = {&left,&right};
+	for (int i=0;i<2;i++) {
+		const std::vector<double>& velocities = tables[i]->getVelocities();
+		const std::vector<double>& units = tables[i]->getUnits();
+		for (unsigned j=0;tables[i]->isOdd() && j<velocities.size();j++) { // The mirrored points
+			out<<(i==0 ? "left " : "right ")<<-velocities[j]<<" "<<-units[j]<<"\n";
+		}
+		for (unsigned j=0;j<velocities.size();j++) {
+			out<<(i==0 ? "left " : "right ")<<velocities[j]<<" "<<units[j]<<"\n";
+		}
+	}
+	return (bool)out;
+}
+
+}
+
+#endif
@@ -0,0 +1,146 @@
+/***********************************************************************/
+/**                                                                    */
+/** command_mux.hpp                                                    */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+
+#ifndef _COMMAND_MUX_HPP_
+#define _COMMAND_MUX_HPP_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+
+namespace utils
+{
+
+/**
+ * An input of the command multiplexer
+ */
+struct MuxInput
+{
+	std::string topic;
+	int priority; // The highest one wins
+	double timeout; // Seconds without messages before the input is inactive
+	double last_time; // CLOCK_MONOTONIC time of the last message, 0 if none
+};
+
+/**
+ * Priority multiplexer of command sources
+ *
+ * A message is accepted if no input with a higher priority has received a
+ * message within its timeout. Between inputs of the same priority, the last
+ * message wins. It only keeps times, the messages are not stored.
+ */
+class CommandMux
+{
+public:
+	CommandMux() : active(-1) {}
+	/**
+	 * Set the inputs from a comma separated list of topic:priority:timeout
+	 * (i.e. "/cmd_vel_joy:10:0.5,/cmd_vel:0:0.5")
+	 *
+	 * @param list the comma separated list
+	 * @return true if success, false otherwise
+	 */
+	bool parse(const std::string& list);
+	/**
+	 * Notify a message from an input
+	 *
+	 * @param input the input index
+	 * @param now CLOCK_MONOTONIC time in seconds
+	 * @return true if the message should be forwarded, false otherwise
+	 */
+	bool accept(int input, double now);
+	/**
+	 * Index of the input of the last accepted message, -1 if none
+	 */
+	int getActive() const {return active;}
+	/**
+	 * Number of inputs
+	 */
+	int size() const {return (int)inputs.size();}
+	/**
+	 * Get an input
+	 */
+	const MuxInput& getInput(int input) const {return inputs[input];}
+
+private:
+	std::vector<MuxInput> inputs;
+	int active;
+};
+
+inline
+bool CommandMux::parse(const std::string& list)
+{
+	inputs.clear();
+	active = -1;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss,item,',')) {
+		if (item.empty()) {
+			continue;
+		}
+		size_t first = item.find(':');
+		size_t second = first==std::string::npos ? first : item.find(':',first+1);
+		if (second==std::string::npos || first==0) {
+			return false;
+		}
+		MuxInput input;
+		char *end;
+		input.topic = item.substr(0,first);
+		std::string priority = item.substr(first+1,second-first-1);
+		input.priority = (int)strtol(priority.c_str(),&end,10);
+		if (priority.empty() || *end!='\0') {
+			return false;
+		}
+		std::string timeout = item.substr(second+1);
+		input.timeout = strtod(timeout.c_str(),&end);
+		if (timeout.empty() || *end!='\0' || input.timeout<=0) {
+			return false;
+		}
+		input.last_time = 0;
+		inputs.push_back(input);
+	}
+	return true;
+}
+
+inline
+bool CommandMux::accept(int input, double now)
+{
+	for (unsigned i=0;i<inputs.size();i++) {
+		if (inputs[i].priority > inputs[input].priority && inputs[i].last_time > 0 &&
+			now - inputs[i].last_time < inputs[i].timeout) {
+			inputs[input].last_time = now;
+			return false;
+		}
+	}
+	inputs[input].last_time = now;
+	active = input;
+	return true;
+}
+
+}
+
+#endif
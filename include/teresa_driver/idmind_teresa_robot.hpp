@@ -28,24 +28,18 @@
 
 #include <iostream>
 #include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/atomic.hpp>
 #include "teresa_robot.hpp"
 #include "serial_interface.hpp"
 #include "timer.hpp"
+#include "priority_mutex.hpp"
 
 
 namespace Teresa
 {
 
-struct Calibration
-{
-	double A_left;
-	double B_left;
-	double A_right;
-	double B_right;
-	bool inverse_left_motor;
-	bool inverse_right_motor;
-};
-
 
 #define WRITTING_TRIES                  5
 
@@ -122,6 +116,12 @@ public:
 	 * @return the name of the board
 	 */
 	const std::string& getName() const {return name;}
+	/**
+	 * Get the time when the last byte of the last response was received
+	 *
+	 * @return CLOCK_MONOTONIC time in seconds (see utils::monotonicNow())
+	 */
+	double getResponseTime() const {return response_time;}
 	
 	unsigned char command[512]; // Command buffer
 	unsigned char response[512]; // Response buffer
@@ -133,6 +133,7 @@ private:
 	void (*printInfo)(const std::string& message); // Function to print Information
 	void (*printError)(const std::string& message);  // Function to print Errors
 	int counter; // Message counter (from 0 to 255)	
+	double response_time; // When the last response was received
 };
 
 /**
@@ -166,22 +167,29 @@ public:
 	virtual bool setVelocity(double linear, double angular);
 	virtual bool setVelocity2(double linear, double angular);
 	virtual bool setVelocityRaw(int16_t leftWheelRef, int16_t rightWheelRef);
+	virtual void getMotorUnits(int16_t& left, int16_t& right) {left = left_units; right = right_units;}
+	virtual bool setCalibration(const Calibration& calibration);
 	virtual bool isStopped();
-	virtual bool getIMD(double& imdl, double& imdr);
+	virtual bool stop();
+	virtual bool emergencyStop(bool stop);
+	virtual bool isEmergencyStopped() {return emergency_stopped;}
+	virtual bool getIMD(double& imdl, double& imdr, double& stamp);
+	virtual bool getTicks(int64_t& left, int64_t& right, double& stamp);
 	virtual bool setHeightVelocity(int velocity);
 	virtual bool setTiltVelocity(int velocity);
 	virtual bool setHeight(int height);
 	virtual bool setTilt(int tilt);
-	virtual bool getHeight(int& height);
-	virtual bool getTilt(int& tilt);
-	virtual bool getButtons(bool& button1, bool& button2);
-	virtual bool getRotaryEncoder(int& rotaryEncoder);
+	virtual bool getHeight(int& height, double& stamp);
+	virtual bool getTilt(int& tilt, double& stamp);
+	virtual bool getButtons(bool& button1, bool& button2, double& stamp);
+	virtual bool getRotaryEncoder(int& rotaryEncoder, double& stamp);
 	virtual bool getTemperature(int& leftMotor, 
 					int& rightMotor, 
 					int& leftDriver, 
 					int& rightDriver, 
 					bool& tiltDriverOverheat, 
-					bool& heightDriverOverheat);
+					bool& heightDriverOverheat,
+					double& stamp);
 	virtual bool enableDCDC(unsigned char mask);
 	virtual bool getDCDC(unsigned char& mask);
 	virtual bool setLeds(const std::vector<unsigned char>& leds);
@@ -189,8 +197,9 @@ public:
 					unsigned char& PC1_level, 
 					unsigned char& motorH_level, 
 					unsigned char& motorL_level, 
-					unsigned char& charger_status);
-	virtual bool getPowerDiagnostics(PowerDiagnostics& diagnostics);
+					unsigned char& charger_status,
+					double& stamp);
+	virtual bool getPowerDiagnostics(PowerDiagnostics& diagnostics, double& stamp);
 private:
 
 	static int16_t bufferToInt(const unsigned char* buffer); // buffer [High_byte:Low_byte] to signed int16
@@ -207,17 +216,29 @@ private:
 	bool setHeightDriverState(unsigned char state);
 
 	bool getHeightStatus(unsigned char& status);
+
+	bool readTicks(int16_t& inc_left, int16_t& inc_right, double& stamp); // Read and accumulate the encoder increments
+	bool sendVelocity(int16_t v_left, int16_t v_right); // SET_MOTOR_VELOCITY, under the board2 lock
+	bool setWheelVelocities(double linear, double angular, const utils::CalibrationTable& left_table,
+				const utils::CalibrationTable& right_table); // Convert with a pair of calibration tables
 	
 
 	IdMindBoard board1; // Sensors board
 	IdMindBoard board2; // Motors board
+	boost::mutex board1_mutex; // A whole transaction (command and response buffers) is done under the lock
+	utils::PriorityMutex board2_mutex; // The emergency stop goes before the queued transactions
 	Calibration calibration;
 	unsigned char number_of_leds; // Number of configured leds
 
 	void (*printInfo)(const std::string& message); // Function to print information
 	void (*printError)(const std::string& message); // Function to print errors
 
-	bool is_stopped; // Is robot stopped?
+	boost::atomic<bool> is_stopped; // Is robot stopped?
+	boost::atomic<bool> emergency_stopped; // Is the emergency stop latched?
+	boost::atomic<int16_t> left_units; // Last motor units sent
+	boost::atomic<int16_t> right_units;
+	int64_t left_ticks; // Cumulative encoder ticks, protected by board2_mutex
+	int64_t right_ticks;
 	int final_dcdc_mask;  // The DCDC mask to set in the destructor
 };
 
@@ -230,7 +251,8 @@ IdMindBoard::IdMindBoard(const std::string& device, const std::string& name,
   name(name),
   printInfo(printInfo),
   printError(printError),
-  counter(-1){}
+  counter(-1),
+  response_time(0){}
 
 inline
 IdMindBoard::~IdMindBoard()
@@ -336,6 +358,7 @@ bool IdMindBoard::communicate(int command_size, int response_size)
 			read_bytes += aux; // update number of read bytes
 		}
 	}
+	response_time = utils::monotonicNow(); // The last byte has just arrived
 	// Response: [Header]...[Message_counter][Checksum_High][Checksum_Low]	
 	
 	if (response[0] != command[0]) { // The first response byte should be equal to the first command byte
@@ -376,6 +399,11 @@ IdMindRobot::IdMindRobot(const std::string& board1,const std::string& board2,
   printInfo(printInfo),
   printError(printError),
   is_stopped(true),
+  emergency_stopped(false),
+  left_units(0),
+  right_units(0),
+  left_ticks(0),
+  right_ticks(0),
   final_dcdc_mask(final_dcdc_mask)
 {
 	bool board1_open = IdMindRobot::board1.open(); // Open Board1 (sensors)
@@ -558,6 +586,7 @@ bool IdMindRobot::enableHeightMotor(bool enable)
 inline
 bool IdMindRobot::setHeightVelocity(int velocity)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	if (velocity<0 || velocity>40) {
 		printError("Invalid height velocity. It should be in [0,40]");
 		return false;
@@ -576,6 +605,7 @@ bool IdMindRobot::setHeightVelocity(int velocity)
 inline
 bool IdMindRobot::setTiltVelocity(int velocity)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	if (velocity<2 || velocity>8) {
 		printError("Invalid tilt velocity. It should be in [0,8]");
 		return false;
@@ -608,6 +638,37 @@ bool IdMindRobot::calibrate(bool calibrate_tilt_system, bool calibrate_height_sy
 
 inline
 bool IdMindRobot::setVelocityRaw(int16_t v_left, int16_t v_right)
+{
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
+	if (emergency_stopped) { // The wheels can only be stopped
+		v_left = 0;
+		v_right = 0;
+	}
+	return sendVelocity(v_left,v_right);
+}
+
+// The priority lock only waits for the transaction in progress
+inline
+bool IdMindRobot::stop()
+{
+	utils::PriorityLockGuard lock(board2_mutex);
+	return sendVelocity(0,0);
+}
+
+// The emergency stop is latched before waiting for the motors board, so no
+// velocity command can be sent after it
+inline
+bool IdMindRobot::emergencyStop(bool stop)
+{
+	emergency_stopped = stop;
+	if (!stop) {
+		return true;
+	}
+	return IdMindRobot::stop();
+}
+
+inline
+bool IdMindRobot::sendVelocity(int16_t v_left, int16_t v_right)
 {
 	board2.command[0] = SET_MOTOR_VELOCITY;
 	board2.command[1] = (unsigned char)(v_left >> 8);
@@ -618,6 +679,8 @@ bool IdMindRobot::setVelocityRaw(int16_t v_left, int16_t v_right)
 		printError("Cannot set velocity");
 		return false;
 	}
+	left_units = v_left;
+	right_units = v_right;
 	return true;
 }
 
@@ -625,53 +688,38 @@ bool IdMindRobot::setVelocityRaw(int16_t v_left, int16_t v_right)
 inline
 bool IdMindRobot::setVelocity(double linear, double angular)
 {
-	linear=saturateLinearVelocity(linear);
-	angular=saturateAngularVelocity(angular);
-	double left_wheel_velocity = saturateLinearVelocity(linear - ROBOT_RADIUS_M*angular);
-	double right_wheel_velocity = saturateLinearVelocity(linear + ROBOT_RADIUS_M*angular);
-	int16_t v_left=0;
-	int16_t v_right=0;
-	if (left_wheel_velocity > LINEAR_VELOCITY_ZERO_THRESHOLD || left_wheel_velocity < -LINEAR_VELOCITY_ZERO_THRESHOLD) {
-		v_left = (int16_t)std::round(fabs(left_wheel_velocity) * calibration.A_left + calibration.B_left);
-		if (calibration.inverse_left_motor) v_left = -v_left;
-		if (left_wheel_velocity<0) v_left *= -1; 
-	}
-	if (right_wheel_velocity > LINEAR_VELOCITY_ZERO_THRESHOLD || right_wheel_velocity < -LINEAR_VELOCITY_ZERO_THRESHOLD) {
-		v_right = (int16_t)std::round(fabs(right_wheel_velocity) * calibration.A_right + calibration.B_right);
-		if (calibration.inverse_right_motor) v_right = -v_right;
-		if (right_wheel_velocity<0) v_right *= -1; 
-	}
-	return setVelocityRaw(v_left,v_right);
+	return setWheelVelocities(linear,angular,calibration.left_table,calibration.right_table);
 }
 
-
 inline
 bool IdMindRobot::setVelocity2(double linear, double angular)
+{
+	return setWheelVelocities(linear,angular,calibration.left_upo_table,calibration.right_upo_table);
+}
+
+inline
+bool IdMindRobot::setWheelVelocities(double linear, double angular,
+				const utils::CalibrationTable& left_table, const utils::CalibrationTable& right_table)
 {
 	linear=saturateLinearVelocity(linear);
 	angular=saturateAngularVelocity(angular);
 	double left_wheel_velocity = saturateLinearVelocity(linear - ROBOT_RADIUS_M*angular);
 	double right_wheel_velocity = saturateLinearVelocity(linear + ROBOT_RADIUS_M*angular);
-	int16_t v_left=0;
-	int16_t v_right=0;
-	if (left_wheel_velocity > LINEAR_VELOCITY_ZERO_THRESHOLD || left_wheel_velocity < -LINEAR_VELOCITY_ZERO_THRESHOLD) {
-		//v_left = (int16_t)std::round(fabs(left_wheel_velocity) * calibration.A_left + calibration.B_left);
-		v_left = (int16_t)std::round(left_wheel_velocity * calibration.A_left + calibration.B_left); 
-		if (calibration.inverse_left_motor) v_left = -v_left;
-		//if (left_wheel_velocity<0) v_left *= -1; 
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex); // The tables can be replaced by setCalibration()
+	if (emergency_stopped) { // The wheels can only be stopped
+		return sendVelocity(0,0);
 	}
-	if (right_wheel_velocity > LINEAR_VELOCITY_ZERO_THRESHOLD || right_wheel_velocity < -LINEAR_VELOCITY_ZERO_THRESHOLD) {
-		//v_right = (int16_t)std::round(fabs(right_wheel_velocity) * calibration.A_right + calibration.B_right);
-		v_right = (int16_t)std::round(right_wheel_velocity * calibration.A_right + calibration.B_right);
-		if (calibration.inverse_right_motor) v_right = -v_right;
-		//if (right_wheel_velocity<0) v_right *= -1; 
-	}
-	return setVelocityRaw(v_left,v_right);
+	return sendVelocity(toMotorUnits(left_wheel_velocity,left_table,calibration.inverse_left_motor),
+				toMotorUnits(right_wheel_velocity,right_table,calibration.inverse_right_motor));
 }
 
-
-
-
+inline
+bool IdMindRobot::setCalibration(const Calibration& calibration)
+{
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
+	IdMindRobot::calibration = calibration;
+	return true;
+}
 
 inline
 bool IdMindRobot::isStopped()
@@ -679,25 +727,61 @@ bool IdMindRobot::isStopped()
 	return is_stopped;
 }
 
+// The board returns the ticks since the last request as signed 16-bit increments,
+// they are accumulated in 64-bit counters. An increment at the limits of the
+// 16-bit range means that the board counter saturated or wrapped around
+// between two requests, so ticks may have been lost.
 inline
-bool IdMindRobot::getIMD(double& imdl, double& imdr)
+bool IdMindRobot::readTicks(int16_t& inc_left, int16_t& inc_right, double& stamp)
 {
 	board2.command[0] = GET_MOTOR_VELOCITY_TICKS;
 	if (!board2.communicate(1,8)) {
 		printError("Cannot get motor velocity ticks");
 		return false;
 	}
-	int16_t inc_left = -bufferToInt(board2.response+1);
-	int16_t inc_right = bufferToInt(board2.response+3);
-	imdl = inc_left==0?0:(double)inc_left*0.00024802;
-	imdr = inc_right==0?0:(double)inc_right*0.00024802;
+	stamp = board2.getResponseTime();
+	int16_t raw_left = bufferToInt(board2.response+1);
+	inc_right = bufferToInt(board2.response+3);
+	if (raw_left == INT16_MIN || raw_left == INT16_MAX || inc_right == INT16_MIN || inc_right == INT16_MAX) {
+		printError("Encoder tick increment out of range, the odometry may have lost ticks");
+	}
+	inc_left = raw_left == INT16_MIN ? INT16_MAX : -raw_left;
+	left_ticks += inc_left;
+	right_ticks += inc_right;
 	is_stopped = inc_left==0 && inc_right==0;
 	return true;
 }
 
+inline
+bool IdMindRobot::getIMD(double& imdl, double& imdr, double& stamp)
+{
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
+	int16_t inc_left,inc_right;
+	if (!readTicks(inc_left,inc_right,stamp)) {
+		return false;
+	}
+	imdl = (double)inc_left*METERS_PER_TICK;
+	imdr = (double)inc_right*METERS_PER_TICK;
+	return true;
+}
+
+inline
+bool IdMindRobot::getTicks(int64_t& left, int64_t& right, double& stamp)
+{
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
+	int16_t inc_left,inc_right;
+	if (!readTicks(inc_left,inc_right,stamp)) {
+		return false;
+	}
+	left = left_ticks;
+	right = right_ticks;
+	return true;
+}
+
 inline
 bool IdMindRobot::setHeight(int height)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	int16_t height_ref = (int16_t)height;
 	if (height_ref<MIN_HEIGHT_MM) {
 		height_ref=MIN_HEIGHT_MM;
@@ -718,6 +802,7 @@ bool IdMindRobot::setHeight(int height)
 inline
 bool IdMindRobot::setTilt(int tilt)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	int16_t tilt_ref = (int16_t)tilt;
 	if (tilt_ref<MIN_TILT_ANGLE_DEGREES) {
 		tilt_ref=MIN_TILT_ANGLE_DEGREES;
@@ -735,32 +820,37 @@ bool IdMindRobot::setTilt(int tilt)
 }
 
 inline
-bool IdMindRobot::getHeight(int& height)
+bool IdMindRobot::getHeight(int& height, double& stamp)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	board2.command[0] = GET_HEIGHT_ACTUAL_POSITION;
 	if (!board2.communicate(1,8)) {
 		printError("Cannot get height");
 		return false;
 	}
 	height = bufferToInt(board2.response+1);
+	stamp = board2.getResponseTime();
 	return true;
 }
 
 inline
-bool IdMindRobot::getTilt(int& tilt)
+bool IdMindRobot::getTilt(int& tilt, double& stamp)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	board2.command[0] = GET_TILT_ACTUAL_POSITION;
 	if (!board2.communicate(1,8)) {
 		printError("Cannot set tilt angle");
 		return false;
 	}
 	tilt = bufferToInt(board2.response+1);
+	stamp = board2.getResponseTime();
 	return true;
 }
 
 inline
-bool IdMindRobot::getButtons(bool& button1, bool& button2)
+bool IdMindRobot::getButtons(bool& button1, bool& button2, double& stamp)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	board2.command[0] = GET_ARCADE_BUTTONS;
 	if (!board2.communicate(1,5)) {
 		printError("Cannot get buttons");
@@ -768,18 +858,21 @@ bool IdMindRobot::getButtons(bool& button1, bool& button2)
 	}
 	button1 = board2.response[1]&0x01;
 	button2 = board2.response[1]&0x02;
+	stamp = board2.getResponseTime();
 	return true;	
 }
 
 inline
-bool IdMindRobot::getRotaryEncoder(int& rotaryEncoder)
+bool IdMindRobot::getRotaryEncoder(int& rotaryEncoder, double& stamp)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	board2.command[0] = GET_ROTARY_ENCODER;
 	if (!board2.communicate(1,5)) {
 		printError("Cannot get rotary encoder");
 		return false;
 	}
 	rotaryEncoder = (int8_t)board2.response[1];
+	stamp = board2.getResponseTime();
 	return true;
 }
 
@@ -789,8 +882,10 @@ bool IdMindRobot::getTemperature(int& leftMotor,
 					int& leftDriver, 
 					int& rightDriver, 
 					bool& tiltDriverOverheat, 
-					bool& heightDriverOverheat)
+					bool& heightDriverOverheat,
+					double& stamp)
 {
+	boost::lock_guard<utils::PriorityMutex> lock(board2_mutex);
 	board2.command[0] = GET_TEMPERATURE_SENSORS;
 	if (!board2.communicate(1,9)) {
 		printError("Cannot get temperature sensors");
@@ -800,6 +895,7 @@ bool IdMindRobot::getTemperature(int& leftMotor,
 	rightMotor = (int8_t)board2.response[2];
 	leftDriver = (int8_t)board2.response[3];
 	rightDriver = (int8_t)board2.response[4];
+	stamp = board2.getResponseTime(); // The sensors, the status responses below are only flags
 		
 	board2.command[0] = GET_TILT_STATUS;
 	if (!board2.communicate(1,5)) {
@@ -820,6 +916,7 @@ bool IdMindRobot::getTemperature(int& leftMotor,
 inline
 bool IdMindRobot::enableDCDC(unsigned char mask)
 {
+	boost::lock_guard<boost::mutex> lock(board1_mutex);
 	board1.command[0] = SET_ENABLE_DCDC_OUTPUT;
 	board1.command[1] = mask;
 	if (!board1.communicate(2,4)) {
@@ -835,6 +932,7 @@ bool IdMindRobot::enableDCDC(unsigned char mask)
 inline
 bool IdMindRobot::getDCDC(unsigned char& mask)
 {
+	boost::lock_guard<boost::mutex> lock(board1_mutex);
 	board1.command[0] = GET_ENABLE_DCDC_OUTPUT;
 	if (!board1.communicate(1,5)) {
 		printError("Cannot get DCDC outputs");
@@ -847,6 +945,7 @@ bool IdMindRobot::getDCDC(unsigned char& mask)
 inline
 bool IdMindRobot::setLeds(const std::vector<unsigned char>& leds)
 {
+	boost::lock_guard<boost::mutex> lock(board1_mutex);
 	if (leds.size() != number_of_leds*3) {
 		printError("Invalid number of RGB values");
 		return false;
@@ -867,8 +966,10 @@ bool IdMindRobot::getBatteryStatus(unsigned char& elec_level,
 					unsigned char& PC1_level, 
 					unsigned char& motorH_level, 
 					unsigned char& motorL_level, 
-					unsigned char& charger_status)
+					unsigned char& charger_status,
+					double& stamp)
 {
+	boost::lock_guard<boost::mutex> lock(board1_mutex);
 	board1.command[0] = GET_BATTERIES_LEVEL;
 	if (!board1.communicate(1,8)) {
 		printError("Cannot get batteries level");
@@ -878,6 +979,7 @@ bool IdMindRobot::getBatteryStatus(unsigned char& elec_level,
 	PC1_level = board1.response[2];
 	motorH_level = board1.response[3];
 	motorL_level = board1.response[4]; 	
+	stamp = board1.getResponseTime();
 	board1.command[0] = GET_CHARGER_STATUS;
 	if (!board1.communicate(1,5)) {
 		printError("Cannor get charger status");
@@ -888,8 +990,9 @@ bool IdMindRobot::getBatteryStatus(unsigned char& elec_level,
 }
 
 inline
-bool IdMindRobot::getPowerDiagnostics(PowerDiagnostics& diagnostics)
+bool IdMindRobot::getPowerDiagnostics(PowerDiagnostics& diagnostics, double& stamp)
 {
+	boost::lock_guard<boost::mutex> lock(board1_mutex);
 	board1.command[0]=GET_POWER_VOLTAGE;
 	if (!board1.communicate(1,11)) {
 		printError("Cannot get power voltage information");
@@ -902,6 +1005,7 @@ bool IdMindRobot::getPowerDiagnostics(PowerDiagnostics& diagnostics)
 	diagnostics.motor_voltage = (double)bufferToUnsignedInt(board1.response+4)/10.0;
 	diagnostics.motor_h_voltage = (double)board1.response[6]/10.0;
 	diagnostics.motor_l_voltage = (double)board1.response[7]/10.0;
+	stamp = board1.getResponseTime();
 
 	board1.command[0]=GET_POWER_CURRENT;
 	if (!board1.communicate(1,12)) {
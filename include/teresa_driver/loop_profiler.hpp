@@ -0,0 +1,229 @@
+/***********************************************************************/
+/**                                                                    */
+/** loop_profiler.hpp                                                  */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _LOOP_PROFILER_HPP_
+#define _LOOP_PROFILER_HPP_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "timer.hpp"
+
+namespace utils
+{
+
+/**
+ * Windowed duration statistics
+ */
+struct DurationStats
+{
+	DurationStats() : p50(0), p99(0), max(0), samples(0) {}
+	double p50; // Median in seconds
+	double p99; // 99th percentile in seconds
+	double max; // Maximum in seconds
+	int samples; // Number of samples in the window
+};
+
+/**
+ * A ring buffer of the last N durations
+ */
+class DurationWindow
+{
+public:
+	DurationWindow() : head(0), count(0) {}
+	/**
+	 * Set the window size and clear it
+	 */
+	void resize(int size) {samples.assign(size,0); head=0; count=0;}
+	/**
+	 * Add a duration in seconds
+	 */
+	void add(double duration)
+	{
+		if (samples.empty()) {
+			return;
+		}
+		samples[head] = duration;
+		head = (head+1) % samples.size();
+		if (count < (int)samples.size()) {
+			count++;
+		}
+	}
+	/**
+	 * Compute the statistics of the window
+	 *
+	 * @param scratch a buffer to sort the samples, it should have the size of the window
+	 * @return the statistics
+	 */
+	DurationStats getStats(std::vector<double>& scratch) const
+	{
+		DurationStats stats;
+		stats.samples = count;
+		if (count==0) {
+			return stats;
+		}
+		std::copy(samples.begin(),samples.begin()+count,scratch.begin());
+		std::vector<double>::iterator end = scratch.begin()+count;
+		std::vector<double>::iterator p50 = scratch.begin()+(count-1)/2;
+		std::vector<double>::iterator p99 = scratch.begin()+(int)std::ceil(0.99*count)-1;
+		std::nth_element(scratch.begin(),p50,end);
+		stats.p50 = *p50;
+		std::nth_element(p50,p99,end);
+		stats.p99 = *p99;
+		stats.max = *std::max_element(p99,end);
+		return stats;
+	}
+	/**
+	 * Mean and standard deviation of the window
+	 */
+	void getMeanAndDeviation(double& mean, double& deviation) const
+	{
+		mean = 0;
+		deviation = 0;
+		if (count==0) {
+			return;
+		}
+		for (int i=0;i<count;i++) {
+			mean += samples[i];
+		}
+		mean /= count;
+		for (int i=0;i<count;i++) {
+			deviation += (samples[i]-mean)*(samples[i]-mean);
+		}
+		deviation = std::sqrt(deviation/count);
+	}
+private:
+	std::vector<double> samples;
+	int head;
+	int count;
+};
+
+/**
+ * Per-section timing of a periodic loop
+ *
+ * Every buffer is allocated when configured, so profiling a cycle does not allocate.
+ * When it is disabled, tic() and toc() do nothing.
+ */
+class LoopProfiler
+{
+public:
+	LoopProfiler() : enabled(false), window(0), last_cycle_start(0) {}
+	/**
+	 * Enable or disable the profiler
+	 *
+	 * @param enabled collect samples?
+	 * @param window number of samples of each section kept for the statistics
+	 */
+	void configure(bool enabled, int window)
+	{
+		LoopProfiler::enabled = enabled;
+		LoopProfiler::window = enabled ? window : 0;
+		for (unsigned i=0;i<sections.size();i++) {
+			sections[i].resize(LoopProfiler::window);
+		}
+		period.resize(LoopProfiler::window);
+		scratch.resize(LoopProfiler::window);
+	}
+	/**
+	 * Is the profiler enabled?
+	 */
+	bool isEnabled() const {return enabled;}
+	/**
+	 * Add a section to profile
+	 *
+	 * @param name the name of the section
+	 * @return the section index
+	 */
+	int addSection(const std::string& name)
+	{
+		names.push_back(name);
+		sections.push_back(DurationWindow());
+		sections.back().resize(window);
+		return (int)sections.size()-1;
+	}
+	/**
+	 * Start timing a section
+	 *
+	 * @return the start time to pass to toc()
+	 */
+	double tic() const {return enabled ? monotonicNow() : 0;}
+	/**
+	 * Finish timing a section
+	 *
+	 * @param section the section index
+	 * @param start the value returned by tic()
+	 */
+	void toc(int section, double start) {if (enabled) sections[section].add(monotonicNow()-start);}
+	/**
+	 * Add a duration measured elsewhere
+	 */
+	void add(int section, double duration) {if (enabled) sections[section].add(duration);}
+	/**
+	 * Mark the start of a cycle to measure the period
+	 *
+	 * @param cycle_start CLOCK_MONOTONIC time of the start of the cycle
+	 */
+	void cycle(double cycle_start)
+	{
+		if (enabled && last_cycle_start>0) {
+			period.add(cycle_start-last_cycle_start);
+		}
+		last_cycle_start = cycle_start;
+	}
+	/**
+	 * Number of sections
+	 */
+	int size() const {return (int)sections.size();}
+	/**
+	 * Name of a section
+	 */
+	const std::string& getName(int section) const {return names[section];}
+	/**
+	 * Statistics of a section
+	 */
+	DurationStats getStats(int section) {return sections[section].getStats(scratch);}
+	/**
+	 * Statistics of the period
+	 */
+	DurationStats getPeriodStats() {return period.getStats(scratch);}
+	/**
+	 * Mean and jitter (standard deviation) of the period
+	 */
+	void getPeriodJitter(double& mean, double& jitter) const {period.getMeanAndDeviation(mean,jitter);}
+
+private:
+	bool enabled;
+	int window;
+	double last_cycle_start;
+	std::vector<std::string> names;
+	std::vector<DurationWindow> sections;
+	DurationWindow period;
+	std::vector<double> scratch;
+};
+
+}
+
+#endif
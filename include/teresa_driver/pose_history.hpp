@@ -0,0 +1,145 @@
+/***********************************************************************/
+/**                                                                    */
+/** pose_history.hpp                                                   */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _POSE_HISTORY_HPP_
+#define _POSE_HISTORY_HPP_
+
+#include <vector>
+#include <cmath>
+
+namespace utils
+{
+
+/**
+ * A timestamped planar pose with its twist
+ */
+struct PoseSample
+{
+	PoseSample() : stamp(0), x(0), y(0), yaw(0), lin_vel(0), ang_vel(0) {}
+	double stamp; // Time in seconds
+	double x; // Position in meters
+	double y;
+	double yaw; // Orientation in radians
+	double lin_vel; // Linear velocity in m/s
+	double ang_vel; // Angular velocity in rad/s
+};
+
+/**
+ * A fixed-capacity history of poses ordered by time
+ *
+ * The buffer is allocated by resize(), so adding samples and querying
+ * them does not allocate. It is not thread-safe.
+ */
+class PoseHistory
+{
+public:
+	PoseHistory() : head(0), count(0) {}
+	/**
+	 * Set the capacity and clear the history
+	 */
+	void resize(int capacity) {samples.assign(capacity > 0 ? capacity : 0,PoseSample()); head=0; count=0;}
+	/**
+	 * Maximum number of samples
+	 */
+	int capacity() const {return (int)samples.size();}
+	/**
+	 * Number of samples in the history
+	 */
+	int size() const {return count;}
+	/**
+	 * Add a sample, the oldest one is dropped if the history is full
+	 *
+	 * @param sample the sample, it must be newer than the last one added
+	 * @return true if success, false if the history is disabled or the sample is out of order
+	 */
+	bool add(const PoseSample& sample);
+	/**
+	 * Get the pose at a given time, interpolated between the two closest samples
+	 *
+	 * @param stamp the time in seconds
+	 * @param sample[OUT] the interpolated sample
+	 * @return true if success, false if the time is out of the history
+	 */
+	bool getPose(double stamp, PoseSample& sample) const;
+
+private:
+	const PoseSample& at(int i) const {return samples[(head + samples.size() - count + i) % samples.size()];} // i-th oldest sample
+	static double normalizeAngle(double angle) {return std::atan2(std::sin(angle),std::cos(angle));}
+
+	std::vector<PoseSample> samples;
+	int head; // Where the next sample is stored
+	int count;
+};
+
+inline
+bool PoseHistory::add(const PoseSample& sample)
+{
+	if (samples.empty() || (count > 0 && sample.stamp <= at(count-1).stamp)) {
+		return false;
+	}
+	samples[head] = sample;
+	head = (head+1) % samples.size();
+	if (count < (int)samples.size()) {
+		count++;
+	}
+	return true;
+}
+
+inline
+bool PoseHistory::getPose(double stamp, PoseSample& sample) const
+{
+	if (count == 0 || stamp < at(0).stamp || stamp > at(count-1).stamp) {
+		return false;
+	}
+	// Binary search of the first sample not older than stamp
+	int first = 0;
+	int last = count-1;
+	while (first < last) {
+		int middle = (first+last)/2;
+		if (at(middle).stamp < stamp) {
+			first = middle+1;
+		} else {
+			last = middle;
+		}
+	}
+	const PoseSample& next = at(first);
+	if (first == 0 || next.stamp == stamp) {
+		sample = next;
+		return true;
+	}
+	const PoseSample& previous = at(first-1);
+	double ratio = (stamp - previous.stamp) / (next.stamp - previous.stamp);
+	sample.stamp = stamp;
+	sample.x = previous.x + ratio * (next.x - previous.x);
+	sample.y = previous.y + ratio * (next.y - previous.y);
+	sample.yaw = normalizeAngle(previous.yaw + ratio * normalizeAngle(next.yaw - previous.yaw));
+	sample.lin_vel = previous.lin_vel + ratio * (next.lin_vel - previous.lin_vel);
+	sample.ang_vel = previous.ang_vel + ratio * (next.ang_vel - previous.ang_vel);
+	return true;
+}
+
+}
+
+#endif
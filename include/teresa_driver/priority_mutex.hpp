@@ -0,0 +1,99 @@
+/***********************************************************************/
+/**                                                                    */
+/** priority_mutex.hpp                                                 */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _PRIORITY_MUTEX_HPP_
+#define _PRIORITY_MUTEX_HPP_
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace utils
+{
+
+/**
+ * A mutex with a priority lock that goes before every normal waiter
+ *
+ * lock() and unlock() make it usable with boost::lock_guard.
+ */
+class PriorityMutex
+{
+public:
+	PriorityMutex() : locked(false), priority_waiters(0) {}
+	/**
+	 * Normal lock, it waits while there are priority waiters
+	 */
+	void lock()
+	{
+		boost::unique_lock<boost::mutex> guard(mutex);
+		while (locked || priority_waiters > 0) {
+			condition.wait(guard);
+		}
+		locked = true;
+	}
+	/**
+	 * Priority lock, it only waits for the current owner
+	 */
+	void lockPriority()
+	{
+		boost::unique_lock<boost::mutex> guard(mutex);
+		priority_waiters++;
+		while (locked) {
+			condition.wait(guard);
+		}
+		priority_waiters--;
+		locked = true;
+	}
+	void unlock()
+	{
+		{
+			boost::lock_guard<boost::mutex> guard(mutex);
+			locked = false;
+		}
+		condition.notify_all();
+	}
+
+private:
+	boost::mutex mutex;
+	boost::condition_variable condition;
+	bool locked;
+	int priority_waiters;
+};
+
+/**
+ * Scoped priority lock of a PriorityMutex
+ */
+class PriorityLockGuard
+{
+public:
+	explicit PriorityLockGuard(PriorityMutex& mutex) : mutex(mutex) {mutex.lockPriority();}
+	~PriorityLockGuard() {mutex.unlock();}
+private:
+	PriorityMutex& mutex;
+};
+
+}
+
+#endif
@@ -0,0 +1,115 @@
+/***********************************************************************/
+/**                                                                    */
+/** ramp_generator.hpp                                                 */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _RAMP_GENERATOR_HPP_
+#define _RAMP_GENERATOR_HPP_
+
+#include <cmath>
+#include <algorithm>
+
+namespace utils
+{
+
+/**
+ * Acceleration and jerk limited ramp of a velocity toward a target
+ *
+ * The acceleration is limited so it can be brought back to zero (with the
+ * jerk limit) right when the velocity reaches the target, so it does not overshoot.
+ */
+class RampGenerator
+{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param max_acceleration in units/s^2
+	 * @param max_jerk in units/s^3
+	 */
+	RampGenerator(double max_acceleration = 1.0, double max_jerk = 5.0)
+	: max_acceleration(max_acceleration), max_jerk(max_jerk), velocity(0), acceleration(0) {}
+	/**
+	 * Set the limits
+	 *
+	 * @param max_acceleration in units/s^2
+	 * @param max_jerk in units/s^3
+	 */
+	void setLimits(double max_acceleration, double max_jerk)
+	{
+		RampGenerator::max_acceleration = std::abs(max_acceleration);
+		RampGenerator::max_jerk = std::abs(max_jerk);
+	}
+	/**
+	 * Jump to a velocity, with zero acceleration
+	 */
+	void reset(double velocity) {RampGenerator::velocity = velocity; acceleration = 0;}
+	/**
+	 * Advance the ramp
+	 *
+	 * @param target the target velocity
+	 * @param dt the time step in seconds
+	 * @return the new velocity
+	 */
+	double update(double target, double dt);
+	/**
+	 * Current velocity
+	 */
+	double getVelocity() const {return velocity;}
+	/**
+	 * Has the ramp reached a target?
+	 */
+	bool isSettled(double target) const {return velocity == target && acceleration == 0;}
+
+private:
+	double max_acceleration;
+	double max_jerk;
+	double velocity;
+	double acceleration;
+};
+
+inline
+double RampGenerator::update(double target, double dt)
+{
+	if (dt <= 0) {
+		return velocity;
+	}
+	double error = target - velocity;
+	// Highest acceleration that can still be brought to zero at the target
+	double desired = std::min(max_acceleration, std::sqrt(2.0 * max_jerk * std::abs(error)));
+	desired = error < 0 ? -desired : desired;
+	double step = max_jerk * dt;
+	acceleration = std::max(acceleration - step, std::min(acceleration + step, desired));
+	double next = velocity + acceleration * dt;
+	if ((error >= 0 && next >= target) || (error <= 0 && next <= target)) {
+		velocity = target;
+		acceleration = 0;
+	} else {
+		velocity = next;
+	}
+	return velocity;
+}
+
+}
+
+#endif
@@ -0,0 +1,150 @@
+/***********************************************************************/
+/**                                                                    */
+/** rate_buffer.hpp                                                    */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _RATE_BUFFER_HPP_
+#define _RATE_BUFFER_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <boost/atomic.hpp>
+
+namespace utils
+{
+
+/**
+ * A rate (i.e. an angular velocity) sampled at a given time
+ */
+struct RateSample
+{
+	RateSample() : stamp(0), rate(0) {}
+	RateSample(double stamp, double rate) : stamp(stamp), rate(rate) {}
+	double stamp; // CLOCK_MONOTONIC time in seconds
+	double rate; // Units per second
+};
+
+/**
+ * A lock-free ring buffer of rate samples integrated over arbitrary intervals
+ *
+ * There must be a single producer thread calling push() and a single consumer
+ * thread calling integrate(). The rate is interpolated linearly between samples,
+ * and held after the newest one until the next sample arrives.
+ */
+class RateBuffer
+{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param capacity maximum number of samples waiting to be integrated
+	 */
+	RateBuffer(unsigned capacity = 256)
+	: samples(capacity), write_index(0), read_index(0), dropped(0), has_last(false) {}
+	/**
+	 * Add a sample (producer side)
+	 *
+	 * @param sample the sample, samples must be pushed in time order
+	 * @return true if success, false if the buffer is full and the sample was dropped
+	 */
+	bool push(const RateSample& sample);
+	/**
+	 * Integrate the rate over an interval (consumer side)
+	 *
+	 * Samples older than the end of the interval are consumed.
+	 * @param start beginning of the interval
+	 * @param end end of the interval
+	 * @return the integral of the rate over [start,end]
+	 */
+	double integrate(double start, double end);
+	/**
+	 * Number of samples dropped because the buffer was full
+	 */
+	unsigned long getDropped() const {return dropped.load(boost::memory_order_relaxed);}
+
+private:
+	static double interpolate(const RateSample& a, const RateSample& b, double t)
+	{
+		return a.rate + (b.rate - a.rate) * (t - a.stamp) / (b.stamp - a.stamp);
+	}
+
+	std::vector<RateSample> samples;
+	boost::atomic<unsigned long> write_index; // Total samples pushed
+	boost::atomic<unsigned long> read_index; // Total samples consumed
+	boost::atomic<unsigned long> dropped;
+	RateSample last; // Newest consumed sample, owned by the consumer
+	bool has_last;
+};
+
+inline
+bool RateBuffer::push(const RateSample& sample)
+{
+	unsigned long w = write_index.load(boost::memory_order_relaxed);
+	if (w - read_index.load(boost::memory_order_acquire) >= samples.size()) {
+		dropped.fetch_add(1,boost::memory_order_relaxed);
+		return false;
+	}
+	samples[w % samples.size()] = sample;
+	write_index.store(w+1,boost::memory_order_release);
+	return true;
+}
+
+inline
+double RateBuffer::integrate(double start, double end)
+{
+	double integral = 0;
+	double t = start; // Integrated up to t
+	unsigned long r = read_index.load(boost::memory_order_relaxed);
+	unsigned long w = write_index.load(boost::memory_order_acquire);
+	for (; r != w && t < end; r++) {
+		const RateSample& next = samples[r % samples.size()];
+		if (!has_last || next.stamp <= last.stamp) {
+			last = next;
+			has_last = true;
+			continue;
+		}
+		if (next.stamp > t) {
+			double t0 = std::max(t,last.stamp);
+			double t1 = std::min(end,next.stamp);
+			if (t0 > t) { // No samples before t0, hold the first rate
+				integral += last.rate * (t0 - t);
+			}
+			// Trapezoid between the interpolated rates at t0 and t1
+			integral += 0.5 * (interpolate(last,next,t0) + interpolate(last,next,t1)) * (t1 - t0);
+			t = t1;
+			if (next.stamp > end) {
+				break; // Keep it for the next interval
+			}
+		}
+		last = next;
+	}
+	read_index.store(r,boost::memory_order_release);
+	if (has_last && t < end) { // No newer samples yet, hold the last rate
+		integral += last.rate * (end - t);
+	}
+	return integral;
+}
+
+}
+
+#endif
@@ -0,0 +1,280 @@
+/***********************************************************************/
+/**                                                                    */
+/** realtime.hpp                                                       */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _REALTIME_HPP_
+#define _REALTIME_HPP_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+#include <alloca.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+namespace utils
+{
+
+/**
+ * Real-time configuration of a thread
+ */
+struct RealtimeConfig
+{
+	RealtimeConfig() : enabled(false), priority(80), lock_memory(true), prefault_stack_size(512*1024) {}
+	bool enabled; // Use the real-time mode?
+	int priority; // SCHED_FIFO priority [1,99]
+	std::vector<int> cpus; // CPU affinity (empty = no pinning)
+	bool lock_memory; // Lock the process memory with mlockall
+	int prefault_stack_size; // Bytes of stack to touch after locking the memory
+};
+
+/**
+ * Parse a comma separated list of CPUs (i.e. "2,3")
+ *
+ * @param list the comma separated list
+ * @param cpus[OUT] the parsed CPU indexes
+ * @return true if success, false otherwise
+ */
+inline
+bool parseCpuList(const std::string& list, std::vector<int>& cpus)
+{
+	cpus.clear();
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss,item,',')) {
+		if (item.empty()) {
+			continue;
+		}
+		char *end;
+		long cpu = strtol(item.c_str(),&end,10);
+		if (*end!='\0' || cpu<0 || cpu>=CPU_SETSIZE) {
+			return false;
+		}
+		cpus.push_back((int)cpu);
+	}
+	return true;
+}
+
+/**
+ * Check a capability in the effective set of the process
+ *
+ * @param capability the capability number (see linux/capability.h)
+ * @return true if the capability is present, false otherwise
+ */
+inline
+bool hasCapability(int capability)
+{
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status,line)) {
+		if (line.compare(0,7,"CapEff:")==0) {
+			unsigned long long caps = strtoull(line.c_str()+7,NULL,16);
+			return (caps >> capability) & 1ULL;
+		}
+	}
+	return false;
+}
+
+/**
+ * Check if the process has the privileges needed by a real-time configuration
+ *
+ * @param config the real-time configuration
+ * @param report[OUT] a human readable report of the privileges
+ * @return true if every privilege is available, false otherwise
+ */
+inline
+bool checkRealtimePrivileges(const RealtimeConfig& config, std::string& report)
+{
+	static const int CAP_IPC_LOCK_BIT = 14;
+	static const int CAP_SYS_NICE_BIT = 23;
+	std::ostringstream ss;
+	bool success = true;
+	bool root = geteuid()==0;
+	struct rlimit limit;
+	if (config.priority < sched_get_priority_min(SCHED_FIFO) ||
+		config.priority > sched_get_priority_max(SCHED_FIFO)) {
+		ss<<"invalid SCHED_FIFO priority "<<config.priority<<"; ";
+		success = false;
+	} else if (root || hasCapability(CAP_SYS_NICE_BIT)) {
+		ss<<"SCHED_FIFO allowed (privileged); ";
+	} else if (getrlimit(RLIMIT_RTPRIO,&limit)==0 && limit.rlim_cur>=(rlim_t)config.priority) {
+		ss<<"SCHED_FIFO allowed (rtprio limit "<<limit.rlim_cur<<"); ";
+	} else {
+		ss<<"SCHED_FIFO priority "<<config.priority<<" not allowed, raise rtprio in /etc/security/limits.conf; ";
+		success = false;
+	}
+	if (config.lock_memory) {
+		if (root || hasCapability(CAP_IPC_LOCK_BIT)) {
+			ss<<"mlockall allowed (privileged)";
+		} else if (getrlimit(RLIMIT_MEMLOCK,&limit)==0 && limit.rlim_cur==RLIM_INFINITY) {
+			ss<<"mlockall allowed (unlimited memlock)";
+		} else {
+			ss<<"mlockall not allowed, set memlock to unlimited in /etc/security/limits.conf";
+			success = false;
+		}
+	} else {
+		ss<<"memory locking disabled";
+	}
+	report = ss.str();
+	return success;
+}
+
+/**
+ * Lock the current and future memory pages of the process
+ *
+ * @param error[OUT] the error message if fail
+ * @return true if success, false otherwise
+ */
+inline
+bool lockMemory(std::string& error)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)==-1) {
+		error = std::string("mlockall: ")+strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Touch the stack of the calling thread so its pages are mapped before
+ * entering the real-time loop
+ *
+ * @param size number of bytes to touch
+ */
+inline
+void prefaultStack(int size)
+{
+	if (size<=0) {
+		return;
+	}
+	volatile unsigned char *stack = (volatile unsigned char *)alloca(size);
+	long page = sysconf(_SC_PAGESIZE);
+	for (int i=0;i<size;i+=(int)page) {
+		stack[i] = 0;
+	}
+}
+
+/**
+ * Set the SCHED_FIFO policy to the calling thread
+ *
+ * @param priority the SCHED_FIFO priority
+ * @param error[OUT] the error message if fail
+ * @return true if success, false otherwise
+ */
+inline
+bool setRealtimePriority(int priority, std::string& error)
+{
+	struct sched_param param;
+	param.sched_priority = priority;
+	int ret = pthread_setschedparam(pthread_self(),SCHED_FIFO,&param);
+	if (ret!=0) {
+		error = std::string("pthread_setschedparam: ")+strerror(ret);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Pin the calling thread to a set of CPUs
+ *
+ * @param cpus the CPU indexes
+ * @param error[OUT] the error message if fail
+ * @return true if success, false otherwise
+ */
+inline
+bool setCpuAffinity(const std::vector<int>& cpus, std::string& error)
+{
+	if (cpus.empty()) {
+		return true;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned i=0;i<cpus.size();i++) {
+		CPU_SET(cpus[i],&set);
+	}
+	int ret = pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+	if (ret!=0) {
+		error = std::string("pthread_setaffinity_np: ")+strerror(ret);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Apply a real-time configuration to the calling thread
+ *
+ * Memory locking is process-wide, so it should be requested only once (by the first configured thread)
+ * @param config the real-time configuration
+ * @param name name of the thread to show in messages
+ * @param lock_memory lock the process memory (if enabled in the configuration)
+ * @param printInfo function to print information messages
+ * @param printError function to print error messages
+ * @return true if every setting was applied, false otherwise
+ */
+inline
+bool configureRealtimeThread(const RealtimeConfig& config, const std::string& name, bool lock_memory,
+				void (*printInfo)(const std::string& message),
+				void (*printError)(const std::string& message))
+{
+	if (!config.enabled) {
+		return true;
+	}
+	bool success = true;
+	std::string error;
+	if (lock_memory && config.lock_memory) {
+		if (lockMemory(error)) {
+			printInfo("Process memory locked");
+		} else {
+			printError("Cannot lock memory: "+error);
+			success = false;
+		}
+	}
+	if (!setCpuAffinity(config.cpus,error)) {
+		printError("Cannot set CPU affinity of "+name+" thread: "+error);
+		success = false;
+	}
+	if (setRealtimePriority(config.priority,error)) {
+		std::ostringstream ss;
+		ss<<name<<" thread running with SCHED_FIFO priority "<<config.priority;
+		printInfo(ss.str());
+	} else {
+		printError("Cannot set real-time priority of "+name+" thread: "+error);
+		success = false;
+	}
+	if (config.lock_memory) {
+		prefaultStack(config.prefault_stack_size);
+	}
+	return success;
+}
+
+}
+
+#endif
@@ -0,0 +1,133 @@
+/***********************************************************************/
+/**                                                                    */
+/** rls_estimator.hpp                                                  */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+
+#ifndef _RLS_ESTIMATOR_HPP_
+#define _RLS_ESTIMATOR_HPP_
+
+#include <cmath>
+
+namespace utils
+{
+
+/**
+ * Recursive least squares estimator of a line y = slope*x + offset
+ *
+ * Old samples are forgotten exponentially. The trace of the covariance is
+ * bounded by its initial value, so it does not blow up while the input is
+ * not exciting (i.e. a constant velocity). It uses constant memory.
+ */
+class LinearRls
+{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param forgetting forgetting factor in (0,1], 1 to never forget
+	 * @param covariance initial covariance of the estimates
+	 */
+	LinearRls(double forgetting = 0.999, double covariance = 1000)
+	: forgetting(forgetting), covariance(covariance) {reset(0,0);}
+	/**
+	 * Set the forgetting factor in (0,1]
+	 */
+	void setForgetting(double forgetting) {LinearRls::forgetting = forgetting;}
+	/**
+	 * Restart the estimation from prior values
+	 *
+	 * @param slope the prior slope
+	 * @param offset the prior offset
+	 */
+	void reset(double slope, double offset)
+	{
+		LinearRls::slope = slope;
+		LinearRls::offset = offset;
+		P[0][0] = covariance; P[0][1] = 0;
+		P[1][0] = 0; P[1][1] = covariance;
+		samples = 0;
+		mean_square = 0;
+	}
+	/**
+	 * Add a sample
+	 *
+	 * @param x the input
+	 * @param y the output
+	 */
+	void update(double x, double y);
+	/**
+	 * Estimated slope
+	 */
+	double getSlope() const {return slope;}
+	/**
+	 * Estimated offset
+	 */
+	double getOffset() const {return offset;}
+	/**
+	 * Number of samples since the last reset
+	 */
+	unsigned long getSamples() const {return samples;}
+	/**
+	 * Root mean square of the prediction errors, with the same forgetting as the estimates
+	 */
+	double getRms() const {return std::sqrt(mean_square);}
+
+private:
+	double forgetting;
+	double covariance; // Initial covariance, also the bound of the trace
+	double slope;
+	double offset;
+	double P[2][2]; // Covariance of (slope,offset)
+	unsigned long samples;
+	double mean_square;
+};
+
+inline
+void LinearRls::update(double x, double y)
+{
+	double error = y - (slope*x + offset);
+	double Pphi0 = P[0][0]*x + P[0][1];
+	double Pphi1 = P[1][0]*x + P[1][1];
+	double gain = forgetting + x*Pphi0 + Pphi1;
+	double K0 = Pphi0 / gain;
+	double K1 = Pphi1 / gain;
+	slope += K0 * error;
+	offset += K1 * error;
+	// P = (P - K*phi'*P) / forgetting, phi'*P = (Pphi0,Pphi1) as P is symmetric
+	double P00 = (P[0][0] - K0*Pphi0) / forgetting;
+	double P01 = (P[0][1] - K0*Pphi1) / forgetting;
+	double P11 = (P[1][1] - K1*Pphi1) / forgetting;
+	double trace = P00 + P11;
+	double scale = trace > 2*covariance ? 2*covariance / trace : 1.0;
+	P[0][0] = P00 * scale;
+	P[0][1] = P01 * scale;
+	P[1][0] = P01 * scale;
+	P[1][1] = P11 * scale;
+	mean_square = samples==0 ? error*error : forgetting*mean_square + (1-forgetting)*error*error;
+	samples++;
+}
+
+}
+
+#endif
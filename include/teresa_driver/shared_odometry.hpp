@@ -0,0 +1,305 @@
+/***********************************************************************/
+/**                                                                    */
+/** shared_odometry.hpp                                                */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _SHARED_ODOMETRY_HPP_
+#define _SHARED_ODOMETRY_HPP_
+
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/atomic.hpp>
+#include "pose_history.hpp"
+
+namespace utils
+{
+
+#define SHARED_ODOMETRY_MAGIC        0x5445524F // "TERO"
+#define SHARED_ODOMETRY_VERSION      1
+#define SHARED_ODOMETRY_HISTORY      512
+#define SHARED_ODOMETRY_MAX_RETRIES  1000 // Reads of an inconsistent segment before giving up
+
+/**
+ * Layout of the shared-memory odometry segment
+ *
+ * It is protected by a seqlock: the sequence is odd while the writer updates
+ * the data, so readers retry if it is odd or it changed while they were copying.
+ * The stamps are in ROS time (seconds).
+ */
+struct SharedOdometryData
+{
+	uint32_t magic;
+	uint32_t version;
+	boost::atomic<uint32_t> sequence;
+	uint32_t capacity; // Size of the history
+	uint64_t count; // Total samples written, the newest one is history[(count-1) % capacity]
+	PoseSample history[SHARED_ODOMETRY_HISTORY];
+};
+
+/**
+ * Writer of the shared-memory odometry, used by the driver
+ */
+class SharedOdometryWriter
+{
+public:
+	SharedOdometryWriter() : data(NULL) {}
+	~SharedOdometryWriter() {close();}
+	/**
+	 * Create the segment
+	 *
+	 * @param name the POSIX shared-memory name (i.e. "/teresa_odometry")
+	 * @param error[OUT] the error message if fail
+	 * @return true if success, false otherwise
+	 */
+	bool open(const std::string& name, std::string& error);
+	/**
+	 * Remove the segment
+	 */
+	void close();
+	/**
+	 * Is the segment open?
+	 */
+	bool isOpen() const {return data!=NULL;}
+	/**
+	 * Publish a new sample
+	 */
+	void write(const PoseSample& sample);
+
+private:
+	SharedOdometryData *data;
+	std::string name;
+};
+
+/**
+ * Reader of the shared-memory odometry, for processes running in the same computer as the driver
+ */
+class SharedOdometryReader
+{
+public:
+	SharedOdometryReader() : data(NULL) {}
+	~SharedOdometryReader() {close();}
+	/**
+	 * Map the segment created by the driver
+	 *
+	 * @param name the POSIX shared-memory name (i.e. "/teresa_odometry")
+	 * @param error[OUT] the error message if fail
+	 * @return true if success, false otherwise
+	 */
+	bool open(const std::string& name, std::string& error);
+	/**
+	 * Unmap the segment
+	 */
+	void close();
+	/**
+	 * Get the newest sample
+	 *
+	 * @param sample[OUT] the newest sample
+	 * @return true if success, false if nothing has been written yet or the segment stays
+	 * inconsistent for SHARED_ODOMETRY_MAX_RETRIES reads (i.e. the writer died while writing)
+	 */
+	bool getLatest(PoseSample& sample) const;
+	/**
+	 * Get the history, from the oldest to the newest sample
+	 *
+	 * @param history[OUT] the samples, it is resized to at most SHARED_ODOMETRY_HISTORY samples
+	 * @return true if success, false if nothing has been written yet or the segment stays
+	 * inconsistent for SHARED_ODOMETRY_MAX_RETRIES reads
+	 */
+	bool getHistory(std::vector<PoseSample>& history) const;
+
+private:
+	const SharedOdometryData *data;
+};
+
+inline
+bool SharedOdometryWriter::open(const std::string& name, std::string& error)
+{
+	close();
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+	if (fd==-1) {
+		error = std::string("shm_open: ")+strerror(errno);
+		return false;
+	}
+	if (ftruncate(fd,sizeof(SharedOdometryData))==-1) {
+		error = std::string("ftruncate: ")+strerror(errno);
+		::close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+	void *ptr = mmap(NULL, sizeof(SharedOdometryData), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (ptr==MAP_FAILED) {
+		error = std::string("mmap: ")+strerror(errno);
+		shm_unlink(name.c_str());
+		return false;
+	}
+	data = (SharedOdometryData*)ptr;
+	SharedOdometryWriter::name = name;
+	data->sequence.store(data->sequence.load() | 1); // Invalid while initializing
+	data->capacity = SHARED_ODOMETRY_HISTORY;
+	data->count = 0;
+	data->version = SHARED_ODOMETRY_VERSION;
+	data->magic = SHARED_ODOMETRY_MAGIC;
+	data->sequence.fetch_add(1,boost::memory_order_release);
+	return true;
+}
+
+inline
+void SharedOdometryWriter::close()
+{
+	if (data!=NULL) {
+		munmap(data,sizeof(SharedOdometryData));
+		shm_unlink(name.c_str());
+		data = NULL;
+	}
+}
+
+inline
+void SharedOdometryWriter::write(const PoseSample& sample)
+{
+	if (data==NULL) {
+		return;
+	}
+	uint32_t sequence = data->sequence.load(boost::memory_order_relaxed);
+	data->sequence.store(sequence+1,boost::memory_order_relaxed);
+	boost::atomic_thread_fence(boost::memory_order_release);
+	data->history[data->count % SHARED_ODOMETRY_HISTORY] = sample;
+	data->count++;
+	data->sequence.store(sequence+2,boost::memory_order_release);
+}
+
+inline
+bool SharedOdometryReader::open(const std::string& name, std::string& error)
+{
+	close();
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd==-1) {
+		error = std::string("shm_open: ")+strerror(errno);
+		return false;
+	}
+	// Mapping beyond the end of the segment would raise SIGBUS on the first read,
+	// i.e. if the writer has not set its size yet
+	struct stat st;
+	if (fstat(fd,&st)==-1) {
+		error = std::string("fstat: ")+strerror(errno);
+		::close(fd);
+		return false;
+	}
+	if (st.st_size < (off_t)sizeof(SharedOdometryData)) {
+		error = "The shared odometry segment "+name+" is too small";
+		::close(fd);
+		return false;
+	}
+	void *ptr = mmap(NULL, sizeof(SharedOdometryData), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (ptr==MAP_FAILED) {
+		error = std::string("mmap: ")+strerror(errno);
+		return false;
+	}
+	data = (const SharedOdometryData*)ptr;
+	if (data->magic != SHARED_ODOMETRY_MAGIC || data->version != SHARED_ODOMETRY_VERSION) {
+		error = "Invalid shared odometry segment "+name;
+		close();
+		return false;
+	}
+	return true;
+}
+
+inline
+void SharedOdometryReader::close()
+{
+	if (data!=NULL) {
+		munmap((void*)data,sizeof(SharedOdometryData));
+		data = NULL;
+	}
+}
+
+inline
+bool SharedOdometryReader::getLatest(PoseSample& sample) const
+{
+	if (data==NULL) {
+		return false;
+	}
+	uint32_t begin,end;
+	uint64_t count;
+	int retries = 0;
+	do {
+		if (retries>0) {
+			if (retries==SHARED_ODOMETRY_MAX_RETRIES) {
+				return false;
+			}
+			sched_yield();
+		}
+		retries++;
+		begin = data->sequence.load(boost::memory_order_acquire);
+		count = data->count;
+		if (count > 0) {
+			sample = data->history[(count-1) % SHARED_ODOMETRY_HISTORY];
+		}
+		boost::atomic_thread_fence(boost::memory_order_acquire);
+		end = data->sequence.load(boost::memory_order_relaxed);
+	} while ((begin & 1) || begin != end);
+	return count > 0;
+}
+
+inline
+bool SharedOdometryReader::getHistory(std::vector<PoseSample>& history) const
+{
+	if (data==NULL) {
+		return false;
+	}
+	history.reserve(SHARED_ODOMETRY_HISTORY);
+	uint32_t begin,end;
+	int retries = 0;
+	do {
+		history.clear();
+		if (retries>0) {
+			if (retries==SHARED_ODOMETRY_MAX_RETRIES) {
+				return false;
+			}
+			sched_yield();
+		}
+		retries++;
+		begin = data->sequence.load(boost::memory_order_acquire);
+		uint64_t count = data->count;
+		uint64_t first = count > SHARED_ODOMETRY_HISTORY ? count - SHARED_ODOMETRY_HISTORY : 0;
+		for (uint64_t i=first;i<count;i++) {
+			history.push_back(data->history[i % SHARED_ODOMETRY_HISTORY]);
+		}
+		boost::atomic_thread_fence(boost::memory_order_acquire);
+		end = data->sequence.load(boost::memory_order_relaxed);
+	} while ((begin & 1) || begin != end);
+	return !history.empty();
+}
+
+}
+
+#endif
@@ -27,6 +27,9 @@
 #define _SIMULATED_TERESA_ROBOT_HPP_
 
 
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/atomic.hpp>
 #include "teresa_robot.hpp"
 #include "timer.hpp"
 
@@ -35,29 +38,38 @@ namespace Teresa
 
 /**
  * An implementation of Teresa::Robot for debugging and testing
+ *
+ * The raw motor units are converted to wheel velocities with the calibration tables
  */
 class SimulatedRobot : public Robot
 {
 public:
-	SimulatedRobot();
+	SimulatedRobot(const Calibration& calibration);
 	virtual ~SimulatedRobot() {}
 	virtual bool setVelocity(double linear, double angular);
 	virtual bool setVelocity2(double linear, double angular);
-	virtual bool setVelocityRaw(int16_t leftWheelRef, int16_t rightWheelRef) {return true;}
+	virtual bool setVelocityRaw(int16_t leftWheelRef, int16_t rightWheelRef);
+	virtual void getMotorUnits(int16_t& left, int16_t& right);
+	virtual bool setCalibration(const Calibration& calibration);
 	virtual bool isStopped();
-	virtual bool getIMD(double& imdl, double& imdr);
+	virtual bool stop() {return setVelocity(0,0);}
+	virtual bool emergencyStop(bool stop);
+	virtual bool isEmergencyStopped() {return emergency_stopped;}
+	virtual bool getIMD(double& imdl, double& imdr, double& stamp);
+	virtual bool getTicks(int64_t& left, int64_t& right, double& stamp);
 	virtual bool setHeightVelocity(int velocity) {return true;}
 	virtual bool setTiltVelocity(int velocity) {return true;}
 	virtual bool setHeight(int height);
 	virtual bool setTilt(int tilt);
-	virtual bool getHeight(int& height) {height = SimulatedRobot::height; return true;}
-	virtual bool getTilt(int& tilt) {tilt = SimulatedRobot::tilt; return true;}
+	virtual bool getHeight(int& height, double& stamp) {height = SimulatedRobot::height; stamp = utils::monotonicNow(); return true;}
+	virtual bool getTilt(int& tilt, double& stamp) {tilt = SimulatedRobot::tilt; stamp = utils::monotonicNow(); return true;}
 	virtual bool getTemperature(int& leftMotor, 
 			int& rightMotor, 
 			int& leftDriver, 
 			int& rightDriver, 
 			bool& tiltDriverOverheat, 
-			bool& heightDriverOverheat)
+			bool& heightDriverOverheat,
+			double& stamp)
 	{
 		leftMotor=35;
 		rightMotor=35;
@@ -65,30 +77,35 @@ public:
 		rightDriver=35;
 		tiltDriverOverheat=false;
 		heightDriverOverheat=false;
+		stamp = utils::monotonicNow();
 		return true;
 	}
 	virtual bool getBatteryStatus(unsigned char& elec_level, 
 					unsigned char& PC1_level, 
 					unsigned char& motorH_level, 
 					unsigned char& motorL_level,
-					unsigned char& charger_status)
+					unsigned char& charger_status,
+					double& stamp)
 	{
 		elec_level=100;
 		PC1_level=100;
 		motorH_level=100;
 		motorL_level=100;
 		charger_status = 0x0F;
+		stamp = utils::monotonicNow();
 		return true;
 	}
-	virtual bool getButtons(bool& button1, bool& button2)
+	virtual bool getButtons(bool& button1, bool& button2, double& stamp)
 	{
 		button1=false;
 		button2=false;
+		stamp = utils::monotonicNow();
 		return true;
 	}
-	virtual bool getRotaryEncoder(int& rotaryEncoder)
+	virtual bool getRotaryEncoder(int& rotaryEncoder, double& stamp)
 	{
 		rotaryEncoder = 0;
+		stamp = utils::monotonicNow();
 		return true;
 	}
 	virtual bool enableDCDC(unsigned char mask)
@@ -105,7 +122,7 @@ public:
 		return true;
 	}
 	virtual bool setLeds(const std::vector<unsigned char>& leds){std::cout<<"Set Leds"<<std::endl;return true;}
-	virtual bool getPowerDiagnostics(PowerDiagnostics& diagnostics)
+	virtual bool getPowerDiagnostics(PowerDiagnostics& diagnostics, double& stamp)
 	{
 		diagnostics.elec_bat_voltage = 0;
 		diagnostics.PC1_bat_voltage = 0;
@@ -117,21 +134,28 @@ public:
 		diagnostics.motor_instant_current = 0;
 		diagnostics.elec_integrated_current = 0;
 		diagnostics.motor_integrated_current = 0; 
+		stamp = utils::monotonicNow();
 		return true;
 	}	
 
 private:
+	void setWheelVelocities(double left, double right); // Under the lock
+	Calibration calibration;
 	double left_wheel_velocity;
 	double right_wheel_velocity;
+	int16_t left_units; // Last motor units
+	int16_t right_units;
 	int height;
         int tilt;
 	double left_meters;
 	double right_meters;
 	double current_left_meters;
 	double current_right_meters;
-	bool is_stopped;
+	boost::atomic<bool> is_stopped; // Written under the lock, read without it
+	boost::atomic<bool> emergency_stopped; // Is the emergency stop latched?
 	unsigned char dcdc_mask;	
 	utils::Timer timer;
+	boost::mutex mutex; // The wheels can be commanded and read from different threads
 	
 
 };
@@ -139,9 +163,12 @@ private:
 
 
 inline
-SimulatedRobot::SimulatedRobot()
-: left_wheel_velocity(0),
+SimulatedRobot::SimulatedRobot(const Calibration& calibration)
+: calibration(calibration),
+  left_wheel_velocity(0),
   right_wheel_velocity(0),
+  left_units(0),
+  right_units(0),
   height(MAX_HEIGHT_MM),
   tilt(0), 
   left_meters(0),
@@ -149,6 +176,7 @@ SimulatedRobot::SimulatedRobot()
   current_left_meters(0),
   current_right_meters(0),
   is_stopped(true),
+  emergency_stopped(false),
   dcdc_mask(0xFF)
 {
 }
@@ -156,17 +184,61 @@ SimulatedRobot::SimulatedRobot()
 inline
 bool SimulatedRobot::setVelocity(double linear, double angular)
 {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	if (emergency_stopped) {
+		linear = 0;
+		angular = 0;
+	}
 	linear=saturateLinearVelocity(linear);
 	angular=saturateAngularVelocity(angular);
+	double left = saturateLinearVelocity(linear - ROBOT_RADIUS_M*angular);
+	double right = saturateLinearVelocity(linear + ROBOT_RADIUS_M*angular);
+	left_units = toMotorUnits(left,calibration.left_table,calibration.inverse_left_motor);
+	right_units = toMotorUnits(right,calibration.right_table,calibration.inverse_right_motor);
+	setWheelVelocities(left,right);
+	return true;
+}	
+
+inline
+bool SimulatedRobot::setVelocityRaw(int16_t leftWheelRef, int16_t rightWheelRef)
+{
+	boost::lock_guard<boost::mutex> lock(mutex);
+	left_units = emergency_stopped ? 0 : leftWheelRef;
+	right_units = emergency_stopped ? 0 : rightWheelRef;
+	double left = calibration.inverse_left_motor ? -left_units : left_units;
+	double right = calibration.inverse_right_motor ? -right_units : right_units;
+	setWheelVelocities(left==0 ? 0 : calibration.left_table.getVelocity(left),
+			right==0 ? 0 : calibration.right_table.getVelocity(right));
+	return true;
+}
+
+inline
+void SimulatedRobot::getMotorUnits(int16_t& left, int16_t& right)
+{
+	boost::lock_guard<boost::mutex> lock(mutex);
+	left = left_units;
+	right = right_units;
+}
+
+inline
+bool SimulatedRobot::setCalibration(const Calibration& calibration)
+{
+	boost::lock_guard<boost::mutex> lock(mutex);
+	SimulatedRobot::calibration = calibration;
+	return true;
+}
+
+inline
+void SimulatedRobot::setWheelVelocities(double left, double right)
+{
 	left_meters+= left_wheel_velocity * timer.elapsed();
 	right_meters+= right_wheel_velocity * timer.elapsed();
-	left_wheel_velocity = saturateLinearVelocity(linear - ROBOT_RADIUS_M*angular);
-	right_wheel_velocity = saturateLinearVelocity(linear + ROBOT_RADIUS_M*angular);
+	left_wheel_velocity = left;
+	right_wheel_velocity = right;
 	timer.init();
 	is_stopped = std::abs(left_wheel_velocity)<= LINEAR_VELOCITY_ZERO_THRESHOLD && 
 			std::abs(right_wheel_velocity)<=LINEAR_VELOCITY_ZERO_THRESHOLD;
-	return true;
-}	
+}
 
 inline
 bool SimulatedRobot::setVelocity2(double linear, double angular)
@@ -174,6 +246,15 @@ bool SimulatedRobot::setVelocity2(double linear, double angular)
 	return setVelocity(linear, angular);
 }
 
+inline
+bool SimulatedRobot::emergencyStop(bool stop)
+{
+	mutex.lock();
+	emergency_stopped = stop;
+	mutex.unlock();
+	return !stop || setVelocity(0,0);
+}
+
 inline
 bool SimulatedRobot::isStopped()
 {
@@ -181,8 +262,9 @@ bool SimulatedRobot::isStopped()
 }
 
 inline
-bool SimulatedRobot::getIMD(double& imdl, double& imdr)
+bool SimulatedRobot::getIMD(double& imdl, double& imdr, double& stamp)
 {
+	boost::lock_guard<boost::mutex> lock(mutex);
 	left_meters+= left_wheel_velocity * timer.elapsed();
 	right_meters+= right_wheel_velocity * timer.elapsed();
 	timer.init();
@@ -190,10 +272,24 @@ bool SimulatedRobot::getIMD(double& imdl, double& imdr)
 	imdr = right_meters - current_right_meters;
 	current_left_meters = left_meters;
 	current_right_meters = right_meters;
+	stamp = utils::monotonicNow();
 	return true;
 	
 }
 
+inline
+bool SimulatedRobot::getTicks(int64_t& left, int64_t& right, double& stamp)
+{
+	boost::lock_guard<boost::mutex> lock(mutex);
+	left_meters+= left_wheel_velocity * timer.elapsed();
+	right_meters+= right_wheel_velocity * timer.elapsed();
+	timer.init();
+	left = (int64_t)std::floor(left_meters / METERS_PER_TICK);
+	right = (int64_t)std::floor(right_meters / METERS_PER_TICK);
+	stamp = utils::monotonicNow();
+	return true;
+}
+
 inline
 bool SimulatedRobot::setHeight(int height)
 {
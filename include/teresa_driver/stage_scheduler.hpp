@@ -0,0 +1,193 @@
+/***********************************************************************/
+/**                                                                    */
+/** stage_scheduler.hpp                                                */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _STAGE_SCHEDULER_HPP_
+#define _STAGE_SCHEDULER_HPP_
+
+#include <string>
+#include <vector>
+#include <limits>
+#include "timer.hpp"
+
+namespace utils
+{
+
+/**
+ * Budget-aware scheduler for the optional stages of a loop cycle
+ *
+ * Stages are added in priority order. In each cycle they run while the
+ * time budget allows it; the stages that do not fit are deferred and get
+ * precedence in the next cycle. A stage deferred max_deferrals consecutive
+ * times runs regardless of the budget, so no stage starves.
+ */
+class StageScheduler
+{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param max_deferrals consecutive deferrals after which a stage is forced to run
+	 */
+	StageScheduler(int max_deferrals = 10)
+	: max_deferrals(max_deferrals), cycle_start(0), budget(0) {}
+	/**
+	 * Add a stage, call it in priority order (highest first)
+	 *
+	 * @param name the name of the stage
+	 * @return the stage index
+	 */
+	int addStage(const std::string& name);
+	/**
+	 * Begin a cycle
+	 *
+	 * @param cycle_start CLOCK_MONOTONIC time when the cycle began (see monotonicNow())
+	 * @param budget seconds available for the whole cycle, infinity to run every stage
+	 */
+	void begin(double cycle_start, double budget);
+	/**
+	 * Get the next stage to run in this cycle
+	 *
+	 * @return the stage index, or -1 if no pending stage fits in the remaining budget
+	 */
+	int next();
+	/**
+	 * Notify that a stage has run
+	 *
+	 * @param stage the stage index
+	 * @param duration seconds spent running it
+	 */
+	void done(int stage, double duration);
+	/**
+	 * End the cycle, the stages not run are deferred and counted as shed
+	 */
+	void end();
+	/**
+	 * Number of stages
+	 */
+	int size() const {return (int)stages.size();}
+	/**
+	 * Name of a stage
+	 */
+	const std::string& getName(int stage) const {return stages[stage].name;}
+	/**
+	 * Number of cycles in which a stage has been shed
+	 */
+	unsigned long getShedCount(int stage) const {return stages[stage].shed;}
+
+private:
+	struct Stage
+	{
+		std::string name;
+		double cost; // Running average of the duration in seconds
+		int deferrals; // Consecutive deferrals
+		bool run; // Run in the current cycle?
+		unsigned long shed; // Number of cycles in which it has been shed
+	};
+	bool fits(const Stage& stage) const;
+
+	std::vector<Stage> stages;
+	int max_deferrals;
+	double cycle_start;
+	double budget;
+};
+
+inline
+int StageScheduler::addStage(const std::string& name)
+{
+	Stage stage;
+	stage.name = name;
+	stage.cost = 0;
+	stage.deferrals = 0;
+	stage.run = false;
+	stage.shed = 0;
+	stages.push_back(stage);
+	return (int)stages.size()-1;
+}
+
+inline
+void StageScheduler::begin(double cycle_start, double budget)
+{
+	StageScheduler::cycle_start = cycle_start;
+	StageScheduler::budget = budget;
+	for (unsigned i=0;i<stages.size();i++) {
+		stages[i].run = false;
+	}
+}
+
+inline
+bool StageScheduler::fits(const Stage& stage) const
+{
+	if (budget == std::numeric_limits<double>::infinity() || stage.deferrals >= max_deferrals) {
+		return true;
+	}
+	return monotonicNow() + stage.cost <= cycle_start + budget;
+}
+
+inline
+int StageScheduler::next()
+{
+	// Deferred stages first, the oldest one before
+	int selected = -1;
+	for (unsigned i=0;i<stages.size();i++) {
+		if (!stages[i].run && stages[i].deferrals>0 && fits(stages[i]) &&
+			(selected==-1 || stages[i].deferrals > stages[selected].deferrals)) {
+			selected = i;
+		}
+	}
+	if (selected!=-1) {
+		return selected;
+	}
+	// Then in priority order
+	for (unsigned i=0;i<stages.size();i++) {
+		if (!stages[i].run && fits(stages[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+inline
+void StageScheduler::done(int stage, double duration)
+{
+	Stage& s = stages[stage];
+	s.run = true;
+	s.deferrals = 0;
+	s.cost = s.cost == 0 ? duration : 0.8 * s.cost + 0.2 * duration;
+}
+
+inline
+void StageScheduler::end()
+{
+	for (unsigned i=0;i<stages.size();i++) {
+		if (!stages[i].run) {
+			stages[i].deferrals++;
+			stages[i].shed++;
+		}
+	}
+}
+
+}
+
+#endif
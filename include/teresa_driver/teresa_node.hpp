@@ -26,8 +26,10 @@
 #define _TERESA_NODE_HPP_
 
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <string>
 #include <cmath>	
+#include <limits>
 #include <tf/transform_broadcaster.h>
 #include <nav_msgs/Odometry.h>			
 #include <geometry_msgs/Twist.h>		
@@ -41,11 +43,39 @@
 #include <teresa_driver/Set_DCDC.h>
 #include <teresa_driver/Get_DCDC.h>
 #include <teresa_driver/Teresa_leds.h>
+#include <teresa_driver/Get_pose.h>
+#include <teresa_driver/Emergency_stop.h>
+#include <teresa_driver/EmergencyStop.h>
 #include <teresa_driver/Diagnostics.h>
 #include <teresa_driver/CmdVelRaw.h>
+#include <teresa_driver/VelocityTrajectory.h>
+#include <teresa_driver/WheelSpeedControl.h>
+#include <teresa_driver/CalibrationEstimate.h>
+#include <teresa_driver/LoopTiming.h>
 #include <teresa_driver/simulated_teresa_robot.hpp>
 #include <teresa_driver/idmind_teresa_robot.hpp>
 #include <teresa_driver/teresa_leds.hpp>
+#include <teresa_driver/realtime.hpp>
+#include <teresa_driver/stage_scheduler.hpp>
+#include <teresa_driver/loop_profiler.hpp>
+#include <teresa_driver/pose_history.hpp>
+#include <teresa_driver/shared_odometry.hpp>
+#include <teresa_driver/rate_buffer.hpp>
+#include <teresa_driver/actuator_model.hpp>
+#include <teresa_driver/axis_planner.hpp>
+#include <teresa_driver/velocity_estimator.hpp>
+#include <teresa_driver/ramp_generator.hpp>
+#include <teresa_driver/velocity_trajectory.hpp>
+#include <teresa_driver/wheel_speed_controller.hpp>
+#include <teresa_driver/command_mux.hpp>
+#include <teresa_driver/rls_estimator.hpp>
+
+//Boost
+#include <boost/atomic.hpp>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <boost/thread.hpp>  // Mutex and odometry thread
+#include <boost/bind.hpp>
 
 namespace Teresa
 {
@@ -68,11 +98,64 @@ public:
 	~Node();
 private:
 	void loop(); // The main loop
+	void odometryLoop(); // The odometry sampling loop, when it runs in its own thread
+	void watchdogLoop(); // Stops the robot when the commands, the IMU or the main loop time out
+	void emergencyStopLoop(); // Serves the emergency stop topic and service
+	void rampLoop(); // Streams the velocity ramp to the robot
+	/**
+	 * A velocity command prepared under ramp_mutex and sent after releasing it
+	 */
+	struct MotorCommand
+	{
+		enum Type {NONE, VELOCITY, VELOCITY2, RAW};
+		MotorCommand() : type(NONE), linear(0), angular(0), left(0), right(0), sequence(0) {}
+		Type type;
+		double linear; // For VELOCITY (setVelocity) and VELOCITY2 (setVelocity2)
+		double angular;
+		int16_t left; // For RAW (setVelocityRaw)
+		int16_t right;
+		unsigned long sequence; // Order of the command, see sendMotorCommand()
+	};
+	void prepareVelocity(double linear, double angular, MotorCommand& command); // A velocity with the configured calibration
+	void prepareRaw(int16_t left, int16_t right, MotorCommand& command); // Raw motor units
+	void sendMotorCommand(const MotorCommand& command); // Send a prepared command unless a newer one or a stop went first
+	static void raiseSequence(boost::atomic<unsigned long>& value, unsigned long sequence);
+	void stopRobot(); // Stop the wheels right now, without ramp
+	void resetCommands(); // Drop the ramp, trajectory and speed control commands
+	double feedforward(double velocity, const utils::CalibrationTable& table); // Open-loop motor units of a wheel speed
+	void controlWheelSpeeds(); // Run the wheel speed controllers with the last encoder sample
+	void updateCalibrationEstimate(); // Add the last encoder sample to the online calibration
+	void publishCalibrationEstimate(double now); // Publish (and apply) the estimates, out of the odometry thread
+	void addCalibrationSample(utils::LinearRls& rls, int16_t units, bool inverse, double velocity, double stamp,
+				int16_t& steady_units, double& steady_since);
+	void prepareCommand(double linear, double angular, MotorCommand& command); // A /cmd_vel or trajectory command
+	void trajectoryLoop(); // Sends the trajectory setpoints on time
+	void armTrajectoryTimer(double time); // Wake up the trajectory thread at a CLOCK_MONOTONIC time
+	void emergencyStopReceived(const teresa_driver::EmergencyStop::ConstPtr& estop); // The emergency stop callback
+	bool emergencyStop(teresa_driver::Emergency_stop::Request &req,
+			teresa_driver::Emergency_stop::Response &res); // The emergency stop service
+	bool setEmergencyStop(bool stop, const ros::Time& request_time); // Latch or clear the emergency stop
+	void updateOdometry(int64_t left_ticks, int64_t right_ticks, double stamp); // Integrate the pose
+	bool updateOdometryTF(geometry_msgs::TransformStamped& transform); // Fill the odometry transform
+	void publishOdometry();
+	void runStage(int stage); // Run an optional stage of the main loop
+	void publishButtons();
+	void publishVolume();
+	void publishBatteries();
+	void publishTemperature();
+	void publishDiagnostics();
+	void updateLeds();
+	bool updateLoopPeriod(utils::PeriodicTimer& timer); // Set the period of the idle or normal mode
+	void publishLoopTiming(const ros::Time& current_time, const utils::PeriodicTimer& timer);
+	void initMessages(); // Allocate the reused messages and set their constant fields
 	void imuReceived(const sensor_msgs::Imu::ConstPtr& imu); // The IMU callback function
 	void stalkReceived(const teresa_driver::Stalk::ConstPtr& stalk); // The joystick stalk callback funcrion
 	void stalkRefReceived(const teresa_driver::StalkRef::ConstPtr& stalk_ref);
+	void updateHead(double current_steady_time); // Send the planned head commands
 	void cmdVelReceived(const geometry_msgs::Twist::ConstPtr& cmd_vel); // The Command vel callback function
 	void cmdVelRawReceived(const teresa_driver::CmdVelRaw::ConstPtr& vel_ref); // The raw vel callback function
+	void muxReceived(const geometry_msgs::Twist::ConstPtr& cmd_vel, int input); // A command of a mux input
+	void trajectoryReceived(const teresa_driver::VelocityTrajectory::ConstPtr& trajectory); // Replace the trajectory
 
 	bool setDCDC(teresa_driver::Set_DCDC::Request  &req,
 			teresa_driver::Set_DCDC::Response &res); // Set DCDC service
@@ -80,36 +163,79 @@ private:
 			teresa_driver::Get_DCDC::Response &res); // Get DCDC service
 	bool teresaLeds(teresa_driver::Teresa_leds::Request &req,
 				teresa_driver::Teresa_leds::Response &res); // The Leds service
+	bool getPose(teresa_driver::Get_pose::Request &req,
+			teresa_driver::Get_pose::Response &res); // Get the odometry at a given time
 
 	static void printInfo(const std::string& message){ROS_INFO("%s",message.c_str());} // Print Info function
 	static void printError(const std::string& message){ROS_ERROR("%s",message.c_str());} // Print Error function
+	static ros::Time toRosTime(double stamp); // From CLOCK_MONOTONIC to ROS time
 	
 	ros::NodeHandle& n;
+	boost::mutex odom_mutex; // Protects the odometry state below
+	double odom_stamp; // CLOCK_MONOTONIC time of the last encoder sample
+	int64_t odom_left_ticks; // Cumulative encoder ticks of the last sample
+	int64_t odom_right_ticks;
+	double pos_x; // Position
+	double pos_y;
 	double lin_vel; // Linear velocity
 	double ang_vel; // Angular velocity
-	bool imu_error; // IMU error?
+	double left_wheel_vel; // Wheel speeds in m/s
+	double right_wheel_vel;
+	boost::atomic<bool> imu_error; // IMU error? Set by the main loop, read by the command threads
 	double yaw; // Yaw angle
-	double inc_yaw; // Yaw increment
-	bool imu_first_time; // Is it the first time we get IMU data?
+	utils::PoseHistory pose_history; // Last odometry poses, stamped in ROS time
+	utils::SharedOdometryWriter shared_odometry; // Odometry for the processes in the same computer
+	utils::RateBuffer imu_rates; // IMU angular velocities waiting to be integrated by the odometry
+	bool velocity_filter; // Estimate the wheel velocities with a Kalman filter?
+	utils::VelocityEstimator left_velocity; // Wheel velocity estimators, in meters
+	utils::VelocityEstimator right_velocity;
 	int using_imu; // Are we using an IMU?
 	int publish_temperature; // Are we going to publish the temperatures? (1 = yes, 0 = no)
 	int publish_buttons; // Are we going to publish the arcade buttons?
 	int publish_volume;  // Are we going to publish the rotary volumen control?
 	int publish_diagnostics; // Are we going to publish diagnostics?
+	int publish_loop_timing; // Are we going to publish the timing of the main loop?
+	double loop_timing_period; // Seconds between loop timing messages
 	int height_velocity; // The configured heght motor velocity in mm/s
 	int tilt_velocity; // The configured tilt motor velocity in degrees/s
 	double freq; // Main loop frequency;
+	double odometry_freq; // Odometry sampling frequency, 0 to sample in the main loop
+	double odometry_publish_freq; // Odometry message frequency when sampling in its own thread
+	double odometry_tf_freq; // Odometry TF frequency when sampling in its own thread
+	int pose_history_size; // Number of odometry poses kept for the get_teresa_pose service
+	utils::OverrunPolicy overrun_policy; // What to do when a loop cycle misses its deadline
         int number_of_leds; // Number of leds
 	bool use_upo_calib;
+	utils::RealtimeConfig realtime; // Real-time configuration of the main loop
+	bool load_shedding; // Run the optional stages only while the cycle budget allows it?
+	double cycle_budget_ratio; // Fraction of the period available for each cycle
+	bool idle_mode; // Slow down the main loop while the robot is parked?
+	double idle_freq; // Main loop frequency in idle mode
+	double idle_timeout; // Seconds stopped and without commands before entering the idle mode
+	boost::atomic<bool> idle; // Is the main loop in idle mode? Written by the callbacks and the trajectory thread
+	bool head_change_detection; // Read the head only while it may be moving?
+	double head_settle_time; // Seconds reading the head after the last command or change
+	double head_keepalive_freq; // Frequency of the unchanged head transforms
+	double head_active_until; // CLOCK_MONOTONIC time until the head is read
+	bool head_prediction; // Predict the head pose between readings?
+	double head_poll_freq; // Frequency of the head readings when predicting
+	utils::ActuatorModel height_model; // In millimeters
+	utils::ActuatorModel tilt_model; // In degrees
+	utils::AxisPlanner height_planner; // In millimeters
+	utils::AxisPlanner tilt_planner; // In degrees
 	// Frame IDs
 	std::string base_frame_id;
 	std::string odom_frame_id;
 	std::string head_frame_id;
 	std::string stalk_frame_id;
 	// Publishers and subscribers
+	tf::TransformBroadcaster tf_broadcaster;
 	ros::Publisher odom_pub;
 	ros::Subscriber cmd_vel_sub;
 	ros::Subscriber cmd_vel_raw_sub;
+	ros::Subscriber trajectory_sub;
+	utils::CommandMux mux; // Velocity command sources, used instead of /cmd_vel if any
+	std::vector<ros::Subscriber> mux_subs;
 	ros::Subscriber imu_sub;
 	ros::Subscriber stalk_sub;
 	ros::Subscriber stalk_ref_sub;
@@ -118,15 +244,15 @@ private:
 	ros::Publisher volume_pub;
 	ros::Publisher diagnostics_pub;
 	ros::Publisher temperature_pub;	
+	ros::Publisher loop_timing_pub;
 	// Services
 	ros::ServiceServer set_dcdc_service;
 	ros::ServiceServer get_dcdc_service;
 	ros::ServiceServer leds_service;
+	ros::ServiceServer pose_service;
 
 	// Some time stamps... see the code below
 	ros::Time imu_time; 
-	ros::Time imu_past_time; 
-	ros::Time cmd_vel_time; 
 
 	Robot *teresa; // The robot interface
 	MotorStatus tiltMotor; // Status of the tilt motor
@@ -134,6 +260,89 @@ private:
 	Leds *leds; // A little bit of fun
 
 	Calibration calibration; // Calibration parameters
+	boost::thread odometry_thread;
+	boost::thread watchdog_thread;
+	bool watchdog; // Run the watchdog thread?
+	double watchdog_freq; // Frequency of the watchdog checks
+	double watchdog_loop_timeout; // Seconds without a main loop cycle before stopping
+	boost::atomic<double> cmd_vel_steady_time; // CLOCK_MONOTONIC times checked by the watchdog
+	boost::atomic<double> imu_steady_time;
+	boost::atomic<double> loop_steady_time;
+	boost::thread emergency_stop_thread;
+	ros::NodeHandle emergency_stop_n; // Uses emergency_stop_queue
+	ros::CallbackQueue emergency_stop_queue; // Not delayed by the main loop callbacks
+	ros::Subscriber emergency_stop_sub;
+	ros::ServiceServer emergency_stop_service;
+	boost::atomic<double> emergency_stop_max_latency; // Worst latency in seconds
+	bool velocity_ramp; // Ramp the commanded velocities?
+	double ramp_freq; // Frequency of the ramp commands
+	boost::thread ramp_thread;
+	boost::mutex ramp_mutex; // Protects the ramp state below, it is never held while talking to the robot
+	boost::mutex send_mutex; // Serializes the prepared commands sent to the robot
+	boost::atomic<unsigned long> command_sequence; // Last sequence given to a command or a stop
+	boost::atomic<unsigned long> stop_sequence; // Sequence of the last stop, older commands are not sent
+	boost::atomic<unsigned long> sent_sequence; // Sequence of the last command sent
+	utils::RampGenerator linear_ramp;
+	utils::RampGenerator angular_ramp;
+	double target_linear; // Last commanded velocities
+	double target_angular;
+	bool ramp_active; // Is the ramp moving or away from zero?
+	bool velocity_trajectory; // Accept timed velocity trajectories?
+	boost::thread trajectory_thread;
+	utils::TrajectoryQueue trajectory; // Protected by ramp_mutex
+	int trajectory_fd; // timerfd of the next setpoint
+	bool speed_control; // Closed-loop wheel speed control?
+	bool publish_speed_control;
+	utils::WheelSpeedController left_controller; // Protected by ramp_mutex
+	utils::WheelSpeedController right_controller;
+	double left_wheel_ref; // Commanded wheel speeds in m/s
+	double right_wheel_ref;
+	bool speed_control_active; // Are the controllers driving the wheels?
+	double speed_control_stamp; // Encoder sample of the last control step
+	ros::Publisher speed_control_pub;
+	teresa_driver::WheelSpeedControl speed_control_msg;
+	bool online_calibration; // Estimate the calibration coefficients?
+	bool online_calibration_apply; // Use the estimates?
+	bool online_calibration_upo; // Estimate units = A*v + B of setVelocity2() instead of |units| = A*|v| + B?
+	double online_calibration_settle_time; // Seconds of constant command before taking samples
+	double online_calibration_min_velocity; // Slower samples are discarded
+	int online_calibration_min_samples; // Samples of each wheel before applying the estimates
+	double online_calibration_period; // Seconds between publications of the estimates
+	double online_calibration_time; // Last publication
+	boost::mutex calibration_mutex; // Protects the estimators, fed by the odometry and read by the main loop
+	utils::LinearRls left_rls; // |units| = A*|v| + B, or units = A*v + B, of each wheel
+	utils::LinearRls right_rls;
+	int16_t left_steady_units; // Motor units of the current steady command
+	int16_t right_steady_units;
+	double left_steady_since; // When the steady command started
+	double right_steady_since;
+	ros::Publisher calibration_pub;
+	teresa_driver::CalibrationEstimate calibration_msg;
+
+	// Optional stages of the main loop, in priority order
+	enum Stage {STAGE_BUTTONS, STAGE_VOLUME, STAGE_BATTERIES, STAGE_TEMPERATURE, STAGE_DIAGNOSTICS, STAGE_LEDS};
+	utils::StageScheduler stages;
+	bool buttons_first_time; // Is it the first time we read the buttons?
+	bool button1; // Last state of the arcade buttons
+	bool button2;
+	// Profiled sections of the main loop, the optional stages go after SECTION_STAGES
+	enum Section {SECTION_CYCLE, SECTION_ODOMETRY_READ, SECTION_ODOMETRY_TF, SECTION_HEAD_READ, SECTION_TF,
+			SECTION_ODOMETRY_PUBLISH, SECTION_SPIN, SECTION_STAGES};
+	utils::LoopProfiler profiler;
+
+	// Messages reused in every cycle, the constant fields are set once
+	enum Transform {TF_STALK, TF_HEAD, TF_ODOM};
+	std::vector<geometry_msgs::TransformStamped> transforms; // Sent with a single call per cycle
+	geometry_msgs::TransformStamped odom_trans; // Odometry transform of the odometry thread
+	nav_msgs::Odometry odom_msg;
+	teresa_driver::Buttons buttons_msg;
+	teresa_driver::Volume volume_msg;
+	teresa_driver::Batteries batteries_msg;
+	teresa_driver::Temperature temperature_msg;
+	teresa_driver::Diagnostics diagnostics_msg;
+	teresa_driver::LoopTiming loop_timing_msg;
+	double loopDurationSum; // For the average loop frequency
+	unsigned long loopCounter;
 
 	bool deadZoneIsActive;
 	double lin_vel_dead_zone;
@@ -147,16 +356,29 @@ private:
 inline
 Node::Node(ros::NodeHandle& n, ros::NodeHandle& pn)
 : n(n), 
+  odom_stamp(0.0),
+  odom_left_ticks(0),
+  odom_right_ticks(0),
+  pos_x(0.0),
+  pos_y(0.0),
   lin_vel(0.0),
   ang_vel(0.0),
+  left_wheel_vel(0.0),
+  right_wheel_vel(0.0),
   imu_error(false),
   yaw(0.0),
-  inc_yaw(0.0),
-  imu_first_time(true),
+  imu_rates(512),
+  idle(false),
+  head_active_until(0),
   teresa(NULL),
   tiltMotor(MOTOR_STOP),
   heightMotor(MOTOR_STOP),
-  leds(NULL)
+  leds(NULL),
+  buttons_first_time(true),
+  button1(false),
+  button2(false),
+  loopDurationSum(0),
+  loopCounter(0)
 {
 	try
 	{
@@ -164,7 +386,12 @@ Node::Node(ros::NodeHandle& n, ros::NodeHandle& pn)
 		std::string board1;
 		std::string board2;
 		std::string leds_pattern;
+		std::string realtime_cpus;
+		std::string cmd_vel_mux;
+		std::string calibration_file;
+		std::string overrun_policy_name;
 		int initial_dcdc_mask,final_dcdc_mask;
+		int loop_timing_window;
 	        // Parameters
 		pn.param<std::string>("board1",board1,"/dev/ttyUSB0");
 		pn.param<std::string>("board2",board2,"/dev/ttyUSB1");
@@ -178,12 +405,105 @@ Node::Node(ros::NodeHandle& n, ros::NodeHandle& pn)
 		pn.param<int>("publish_buttons", publish_buttons, 1);
 		pn.param<int>("publish_volume", publish_volume, 1);
 		pn.param<int>("publish_diagnostics",publish_diagnostics,1);
+		pn.param<int>("publish_loop_timing",publish_loop_timing,0);
+		pn.param<double>("loop_timing_period",loop_timing_period,5.0);
+		pn.param<int>("loop_timing_window",loop_timing_window,200);
 		pn.param<int>("number_of_leds",number_of_leds,60);
 		pn.param<int>("initial_dcdc_mask",initial_dcdc_mask,0xFF);
 		pn.param<int>("final_dcdc_mask",final_dcdc_mask,0x00);
 		pn.param<double>("freq",freq,20);
+		pn.param<double>("odometry_freq",odometry_freq,0);
+		pn.param<double>("odometry_publish_freq",odometry_publish_freq,20);
+		pn.param<double>("odometry_tf_freq",odometry_tf_freq,20);
+		pn.param<int>("pose_history_size",pose_history_size,1000);
+		double velocity_filter_jerk;
+		pn.param<bool>("velocity_filter",velocity_filter,false);
+		pn.param<double>("velocity_filter_jerk",velocity_filter_jerk,5.0);
+		left_velocity.configure(velocity_filter_jerk,METERS_PER_TICK);
+		right_velocity.configure(velocity_filter_jerk,METERS_PER_TICK);
+		pose_history.resize(pose_history_size);
+		std::string shared_odometry_name;
+		pn.param<std::string>("shared_odometry",shared_odometry_name,"");
+		if (!shared_odometry_name.empty()) {
+			std::string error;
+			if (shared_odometry.open(shared_odometry_name,error)) {
+				ROS_INFO("Odometry shared in %s",shared_odometry_name.c_str());
+			} else {
+				ROS_ERROR("Cannot share the odometry in %s: %s",shared_odometry_name.c_str(),error.c_str());
+			}
+		}
+		pn.param<std::string>("overrun_policy",overrun_policy_name,"skip");
+		pn.param<bool>("load_shedding",load_shedding,false);
+		pn.param<double>("cycle_budget_ratio",cycle_budget_ratio,0.8);
+		pn.param<bool>("idle_mode",idle_mode,false);
+		pn.param<double>("idle_freq",idle_freq,2);
+		pn.param<double>("idle_timeout",idle_timeout,10);
+		double max_linear_acceleration,max_angular_acceleration,max_linear_jerk,max_angular_jerk;
+		pn.param<bool>("velocity_ramp",velocity_ramp,false);
+		pn.param<double>("ramp_freq",ramp_freq,50);
+		pn.param<double>("max_linear_acceleration",max_linear_acceleration,0.5);
+		pn.param<double>("max_angular_acceleration",max_angular_acceleration,1.5);
+		pn.param<double>("max_linear_jerk",max_linear_jerk,2.0);
+		pn.param<double>("max_angular_jerk",max_angular_jerk,6.0);
+		linear_ramp.setLimits(max_linear_acceleration,max_linear_jerk);
+		angular_ramp.setLimits(max_angular_acceleration,max_angular_jerk);
+		target_linear = 0;
+		target_angular = 0;
+		ramp_active = false;
+		command_sequence = 0;
+		stop_sequence = 0;
+		sent_sequence = 0;
+		int trajectory_capacity;
+		pn.param<bool>("velocity_trajectory",velocity_trajectory,false);
+		pn.param<int>("trajectory_capacity",trajectory_capacity,100);
+		trajectory.reserve(trajectory_capacity);
+		trajectory_fd = -1;
+		double speed_control_kp,speed_control_ki,speed_control_max_output;
+		pn.param<bool>("speed_control",speed_control,false);
+		pn.param<bool>("publish_speed_control",publish_speed_control,true);
+		pn.param<double>("speed_control_kp",speed_control_kp,20.0);
+		pn.param<double>("speed_control_ki",speed_control_ki,60.0);
+		pn.param<double>("speed_control_max_output",speed_control_max_output,100.0);
+		left_controller.setGains(speed_control_kp,speed_control_ki,speed_control_max_output);
+		right_controller.setGains(speed_control_kp,speed_control_ki,speed_control_max_output);
+		left_wheel_ref = 0;
+		right_wheel_ref = 0;
+		speed_control_active = false;
+		speed_control_stamp = 0;
+		double online_calibration_forgetting;
+		pn.param<bool>("online_calibration",online_calibration,false);
+		pn.param<bool>("online_calibration_apply",online_calibration_apply,false);
+		pn.param<double>("online_calibration_forgetting",online_calibration_forgetting,0.999);
+		pn.param<double>("online_calibration_settle_time",online_calibration_settle_time,0.5);
+		pn.param<double>("online_calibration_min_velocity",online_calibration_min_velocity,0.03);
+		pn.param<int>("online_calibration_min_samples",online_calibration_min_samples,500);
+		pn.param<double>("online_calibration_period",online_calibration_period,5.0);
+		left_rls.setForgetting(online_calibration_forgetting);
+		right_rls.setForgetting(online_calibration_forgetting);
+		online_calibration_time = 0;
+		left_steady_units = 0;
+		right_steady_units = 0;
+		left_steady_since = 0;
+		right_steady_since = 0;
+		pn.param<bool>("watchdog",watchdog,false);
+		pn.param<double>("watchdog_freq",watchdog_freq,200);
+		pn.param<double>("watchdog_loop_timeout",watchdog_loop_timeout,1.0);
+		pn.param<bool>("head_change_detection",head_change_detection,false);
+		pn.param<double>("head_settle_time",head_settle_time,2.0);
+		pn.param<double>("head_keepalive_freq",head_keepalive_freq,1.0);
+		pn.param<bool>("head_prediction",head_prediction,false);
+		pn.param<double>("head_poll_freq",head_poll_freq,2.0);
 		pn.param<int>("height_velocity",height_velocity,20);
 		pn.param<int>("tilt_velocity",tilt_velocity,2);
+		height_model.setVelocity(height_velocity);
+		tilt_model.setVelocity(tilt_velocity);
+		double head_height_rate,head_tilt_rate;
+		pn.param<double>("head_height_rate",head_height_rate,0);
+		pn.param<double>("head_tilt_rate",head_tilt_rate,0);
+		height_planner.setLimits(MIN_HEIGHT_MM,MAX_HEIGHT_MM);
+		height_planner.setMaxRate(head_height_rate);
+		tilt_planner.setLimits(MIN_TILT_ANGLE_DEGREES,MAX_TILT_ANGLE_DEGREES);
+		tilt_planner.setMaxRate(head_tilt_rate);
 		pn.param<bool>("inverse_left_motor",calibration.inverse_left_motor,true);
 		pn.param<bool>("inverse_right_motor",calibration.inverse_right_motor,false);
 		pn.param<std::string>("leds_pattern",leds_pattern,"null");
@@ -191,18 +511,73 @@ Node::Node(ros::NodeHandle& n, ros::NodeHandle& pn)
 		pn.param<double>("B_left",calibration.B_left,0.0); //8.35);
 		pn.param<double>("A_right",calibration.A_right,41.2); //210.0);
 		pn.param<double>("B_right",calibration.B_right,0.0); //8.35);
+		pn.param<std::string>("calibration_file",calibration_file,"");
 		pn.param<bool>("use_upo_calib",use_upo_calib, true);
 		pn.param<bool>("deadZoneIsActive", deadZoneIsActive, true);
 		pn.param<double>("lin_vel_dead_zone",lin_vel_dead_zone,0.15);
 		pn.param<double>("ang_vel_dead_zone",ang_vel_dead_zone,0.3);
 		pn.param<double>("lin_vel_zero_threshold",lin_vel_zero_threshold,0.05);
 		pn.param<double>("ang_vel_zero_threshold",ang_vel_zero_threshold,0.05);
+		pn.param<bool>("realtime",realtime.enabled,false);
+		pn.param<int>("realtime_priority",realtime.priority,80);
+		pn.param<std::string>("realtime_cpus",realtime_cpus,"");
+		pn.param<std::string>("cmd_vel_mux",cmd_vel_mux,"");
+		pn.param<bool>("lock_memory",realtime.lock_memory,true);
+		pn.param<int>("prefault_stack_size",realtime.prefault_stack_size,512*1024);
 		leds = getLedsPattern(leds_pattern,number_of_leds);
+		if (overrun_policy_name == "compress") {
+			overrun_policy = utils::OVERRUN_COMPRESS;
+		} else {
+			if (overrun_policy_name != "skip") {
+				ROS_ERROR("Invalid overrun_policy %s, using skip",overrun_policy_name.c_str());
+			}
+			overrun_policy = utils::OVERRUN_SKIP;
+		}
+		std::string calibration_error;
+		if (!initCalibrationTables(calibration,calibration_file,calibration_error)) {
+			ROS_ERROR("Invalid calibration: %s",calibration_error.c_str());
+			if (calibration.left_table.isEmpty() || calibration.right_table.isEmpty() ||
+				calibration.left_upo_table.isEmpty() || calibration.right_upo_table.isEmpty()) {
+				throw ("Teresa initialization aborted: no calibration tables");
+			}
+		} else if (!calibration_file.empty()) {
+			ROS_INFO("Calibration tables loaded from %s",calibration_file.c_str());
+			if (online_calibration_apply) {
+				ROS_WARN("online_calibration_apply ignored: the estimates are lines, they would replace the tables of %s",
+						calibration_file.c_str());
+				online_calibration_apply = false;
+			}
+		}
+		// The estimated model is the one of the velocity commands, and its active tables are the prior
+		online_calibration_upo = use_upo_calib && !speed_control;
+		double prior[4] = {calibration.A_left,calibration.B_left,calibration.A_right,calibration.B_right};
+		fitCalibrationTable(online_calibration_upo ? calibration.left_upo_table : calibration.left_table,
+					!online_calibration_upo,prior[0],prior[1]);
+		fitCalibrationTable(online_calibration_upo ? calibration.right_upo_table : calibration.right_table,
+					!online_calibration_upo,prior[2],prior[3]);
+		left_rls.reset(prior[0],prior[1]);
+		right_rls.reset(prior[2],prior[3]);
+		if (!mux.parse(cmd_vel_mux)) {
+			ROS_ERROR("Invalid cmd_vel_mux list: %s, using /cmd_vel",cmd_vel_mux.c_str());
+			mux.parse("");
+		}
+		if (!utils::parseCpuList(realtime_cpus,realtime.cpus)) {
+			ROS_ERROR("Invalid realtime_cpus list: %s",realtime_cpus.c_str());
+			realtime.cpus.clear();
+		}
+		if (realtime.enabled) {
+			std::string report;
+			if (utils::checkRealtimePrivileges(realtime,report)) {
+				ROS_INFO("Real-time privileges: %s",report.c_str());
+			} else {
+				ROS_WARN("Missing real-time privileges: %s",report.c_str());
+			}
+		}
 		
 		if (simulation) {
 			using_imu=0;
 			// Using a simulated robot, for debugging and testing
-			teresa = new SimulatedRobot(); 
+			teresa = new SimulatedRobot(calibration); 
 		} else {
 			// Using the IdMind robot
 			teresa = new IdMindRobot(board1,board2,calibration,initial_dcdc_mask,final_dcdc_mask,number_of_leds,printInfo,printError);
@@ -211,8 +586,25 @@ Node::Node(ros::NodeHandle& n, ros::NodeHandle& pn)
 		teresa->setTiltVelocity(tilt_velocity);
 		// Publishers and subscribers
 		odom_pub = pn.advertise<nav_msgs::Odometry>(odom_frame_id, 5);
-		cmd_vel_sub = n.subscribe<geometry_msgs::Twist>("/cmd_vel",1,&Node::cmdVelReceived,this);
+		if (mux.size() == 0) {
+			cmd_vel_sub = n.subscribe<geometry_msgs::Twist>("/cmd_vel",1,&Node::cmdVelReceived,this);
+		}
+		for (int i=0;i<mux.size();i++) {
+			mux_subs.push_back(n.subscribe<geometry_msgs::Twist>(mux.getInput(i).topic,1,
+						boost::bind(&Node::muxReceived,this,_1,i)));
+			ROS_INFO("Velocity command source %s, priority %d, timeout %.2f s",mux.getInput(i).topic.c_str(),
+					mux.getInput(i).priority,mux.getInput(i).timeout);
+		}
 		cmd_vel_raw_sub = n.subscribe<teresa_driver::CmdVelRaw>("/cmd_vel_raw",1,&Node::cmdVelRawReceived,this);
+		if (velocity_trajectory) {
+			trajectory_fd = timerfd_create(CLOCK_MONOTONIC,0);
+			if (trajectory_fd==-1) {
+				ROS_ERROR("Cannot create the trajectory timer: %s",strerror(errno));
+			} else {
+				trajectory_sub = n.subscribe<teresa_driver::VelocityTrajectory>("/cmd_vel_trajectory",1,
+											&Node::trajectoryReceived,this);
+			}
+		}
 		if (using_imu) {
 			imu_sub = n.subscribe<sensor_msgs::Imu>("/imu/data",1,&Node::imuReceived,this);	
 		}
@@ -230,13 +622,74 @@ Node::Node(ros::NodeHandle& n, ros::NodeHandle& pn)
 		if (publish_diagnostics) {
 			diagnostics_pub = pn.advertise<teresa_driver::Diagnostics>("/teresa_diagnostics",5);
 		}
+		if (publish_loop_timing) {
+			loop_timing_pub = pn.advertise<teresa_driver::LoopTiming>("/teresa_loop_timing",5);
+		}
+		if (online_calibration) {
+			calibration_pub = pn.advertise<teresa_driver::CalibrationEstimate>("/teresa_calibration_estimate",5);
+		}
+		if (speed_control && publish_speed_control) {
+			speed_control_pub = pn.advertise<teresa_driver::WheelSpeedControl>("/teresa_speed_control",5);
+		}
 		batteries_pub = pn.advertise<teresa_driver::Batteries>("/batteries",5);	
+		// Optional stages, the order is the priority
+		stages.addStage("buttons");
+		stages.addStage("volume");
+		stages.addStage("batteries");
+		stages.addStage("temperature");
+		stages.addStage("diagnostics");
+		stages.addStage("leds");
+		// Profiled sections, in the order of the Section enumeration
+		profiler.addSection("cycle");
+		profiler.addSection("odometry_read");
+		profiler.addSection("odometry_tf");
+		profiler.addSection("head_read");
+		profiler.addSection("tf");
+		profiler.addSection("odometry_publish");
+		profiler.addSection("spin");
+		for (int i=0;i<stages.size();i++) {
+			profiler.addSection(stages.getName(i));
+		}
+		profiler.configure(publish_loop_timing,loop_timing_window);
+		initMessages();
 		// Services
 		set_dcdc_service = n.advertiseService("set_teresa_dcdc", &Node::setDCDC,this);
 		get_dcdc_service = n.advertiseService("get_teresa_dcdc", &Node::getDCDC,this);				
 		leds_service = n.advertiseService("teresa_leds", &Node::teresaLeds,this);
+		if (pose_history_size > 0) {
+			pose_service = n.advertiseService("get_teresa_pose", &Node::getPose,this);
+		}
+		// The main loop does all the serial communication, so it is the thread to promote
+		utils::configureRealtimeThread(realtime,"main loop",true,printInfo,printError);
+		if (odometry_freq > 0) {
+			odometry_thread = boost::thread(&Node::odometryLoop,this);
+		}
+		// The emergency stop has its own callback queue and thread
+		emergency_stop_n.setCallbackQueue(&emergency_stop_queue);
+		emergency_stop_sub = emergency_stop_n.subscribe<teresa_driver::EmergencyStop>("/emergency_stop",5,&Node::emergencyStopReceived,this);
+		emergency_stop_service = emergency_stop_n.advertiseService("teresa_emergency_stop", &Node::emergencyStop,this);
+		emergency_stop_max_latency = 0;
+		emergency_stop_thread = boost::thread(&Node::emergencyStopLoop,this);
+		if (velocity_ramp) {
+			ramp_thread = boost::thread(&Node::rampLoop,this);
+		}
+		if (trajectory_fd!=-1) {
+			trajectory_thread = boost::thread(&Node::trajectoryLoop,this);
+		}
+		if (watchdog) {
+			double now = utils::monotonicNow();
+			cmd_vel_steady_time = now;
+			imu_steady_time = now;
+			loop_steady_time = now;
+			watchdog_thread = boost::thread(&Node::watchdogLoop,this);
+		}
 		// Run the main loop
 		loop();
+		odometry_thread.join();
+		watchdog_thread.join();
+		emergency_stop_thread.join();
+		ramp_thread.join();
+		trajectory_thread.join();
 	} catch (const char* msg) {
 		// I have a bad feeling about this...
 		ROS_FATAL("%s",msg);
@@ -255,107 +708,476 @@ inline
 void Node::imuReceived(const sensor_msgs::Imu::ConstPtr& imu)
 {
 	imu_time = ros::Time::now();
-	// The first time we get data from the IMU
-	if (imu_first_time) {
-		imu_past_time = imu->header.stamp;
-		imu_first_time=false;
-		return;
-	}
-	// Calculate the duration since the last received message
-	double duration = (imu->header.stamp - imu_past_time).toSec();
-	// Update the time of the last received message
-	imu_past_time=imu->header.stamp; 
+	imu_steady_time = utils::monotonicNow();
+	// The rates are integrated by the odometry over each encoder interval,
+	// so the sample time is moved to CLOCK_MONOTONIC
+	double stamp = utils::monotonicNow() - (imu_time - imu->header.stamp).toSec();
 	// Is the robot stopped?
-    	if (teresa->isStopped() || fabs(imu->angular_velocity.z) < 0.04) {
-		ang_vel = 0.0;
-		return;
+	double rate = 0.0;
+    	if (!teresa->isStopped() && fabs(imu->angular_velocity.z) >= 0.04) {
+		rate = imu->angular_velocity.z;
+	}
+	if (!imu_rates.push(utils::RateSample(stamp,rate))) {
+		ROS_WARN_THROTTLE(1,"IMU buffer full, dropping samples");
 	}
-	// Get angular velocity from IMU
-	ang_vel = imu->angular_velocity.z;
-	// Increment yaw angle
-	inc_yaw += ang_vel * duration;
 }
 
-// Stalk callback function (command from joystick)
+// Stalk callback function (command from joystick), the commands are sent by updateHead()
 inline
 void Node::stalkReceived(const teresa_driver::Stalk::ConstPtr& stalk)
 { 
-	if (stalk->head_up && heightMotor!=MOTOR_UP) { // height motor UP
-		teresa->setHeight(MAX_HEIGHT_MM);
-		heightMotor = MOTOR_UP;
+	idle = false;
+	head_active_until = utils::monotonicNow() + head_settle_time;
+	MotorStatus height_status = stalk->head_up ? MOTOR_UP : stalk->head_down ? MOTOR_DOWN : MOTOR_STOP;
+	if (height_status != heightMotor) {
+		height_planner.jog(height_status==MOTOR_UP ? 1 : height_status==MOTOR_DOWN ? -1 : 0);
+		heightMotor = height_status;
 	}
-	else // height motor DOWN
-	if (stalk->head_down && heightMotor!=MOTOR_DOWN) {
-		teresa->setHeight(MIN_HEIGHT_MM);
-		heightMotor = MOTOR_DOWN;
+	MotorStatus tilt_status = stalk->tilt_up ? MOTOR_UP : stalk->tilt_down ? MOTOR_DOWN : MOTOR_STOP;
+	if (tilt_status != tiltMotor) {
+		tilt_planner.jog(tilt_status==MOTOR_UP ? 1 : tilt_status==MOTOR_DOWN ? -1 : 0);
+		tiltMotor = tilt_status;
 	}
-	else if (heightMotor!=MOTOR_STOP){ // height motor STOP
-		int height_in_millimeters=0;
-		if (teresa->getHeight(height_in_millimeters) &&
-			teresa->setHeight(height_in_millimeters)) {
-			heightMotor = MOTOR_STOP;
+}
+
+// StalkRef callback function, the commands are sent by updateHead()
+inline
+void Node::stalkRefReceived(const teresa_driver::StalkRef::ConstPtr& stalk_ref)
+{ 
+	idle = false;
+	head_active_until = utils::monotonicNow() + head_settle_time;
+	height_planner.setReference(stalk_ref->head_height*1000); // From meters to millimeters
+	tilt_planner.setReference(stalk_ref->head_tilt * 57.2958); // From radians to degrees
+	heightMotor = MOTOR_STOP;
+	tiltMotor = MOTOR_STOP;
+}
+
+// Send the head commands planned for this cycle, only when they change. A stop is
+// commanded at the estimated position, so the head is not read again to stop it.
+inline
+void Node::updateHead(double current_steady_time)
+{
+	int command;
+	if (height_model.isValid() && 
+		height_planner.update(height_model.predict(current_steady_time),current_steady_time,command)) {
+		if (teresa->setHeight(command)) {
+			height_model.setTarget(command);
+		} else {
+			height_planner.retry();
 		}
 	}
-	
-	if (stalk->tilt_up && tiltMotor!=MOTOR_UP) { //tilt motor UP
-		teresa->setTilt(MAX_TILT_ANGLE_DEGREES);
-		tiltMotor = MOTOR_UP;
+	if (tilt_model.isValid() &&
+		tilt_planner.update(tilt_model.predict(current_steady_time),current_steady_time,command)) {
+		if (teresa->setTilt(command)) {
+			tilt_model.setTarget(command);
+		} else {
+			tilt_planner.retry();
+		}
 	}
-	else
-	if (stalk->tilt_down && tiltMotor!=MOTOR_DOWN) { // tilt motor DOWN
-		teresa->setTilt(MIN_TILT_ANGLE_DEGREES);
-		tiltMotor = MOTOR_DOWN;
+}
+
+// CmdVel callback function
+inline
+void Node::cmdVelReceived(const geometry_msgs::Twist::ConstPtr& cmd_vel)
+{ 
+	cmd_vel_steady_time = utils::monotonicNow();
+	idle = false; // Leave the idle mode, the command below is sent right now
+	MotorCommand command;
+	{
+		boost::lock_guard<boost::mutex> lock(ramp_mutex);
+		trajectory.clear(); // The last command wins
+		if (!imu_error) { // If IMU error, do not move!
+			prepareCommand(cmd_vel->linear.x,cmd_vel->angular.z,command);
+		}
 	}
-	else if (tiltMotor!=MOTOR_STOP){ // tilt motor STOP
-		int tilt_in_degrees=0;
-		if (teresa->getTilt(tilt_in_degrees) &&
-			teresa->setTilt(tilt_in_degrees)) {
-			tiltMotor = MOTOR_STOP;
+	sendMotorCommand(command);
+}
+
+// Prepare a /cmd_vel or trajectory command, none if it goes through the ramp
+// @precondition ramp_mutex should be locked
+inline
+void Node::prepareCommand(double cmdLinVel, double cmdAngVel, MotorCommand& command)
+{
+	if(deadZoneIsActive) {
+		odom_mutex.lock();
+		double lin_vel = Node::lin_vel;
+		double ang_vel = Node::ang_vel;
+		odom_mutex.unlock();
+		//if robot is (almost) stopped
+		if(fabs(lin_vel) < lin_vel_zero_threshold && fabs(ang_vel) < ang_vel_zero_threshold)
+		{
+			if (fabs(cmdAngVel)>0 && fabs(cmdAngVel)<ang_vel_dead_zone && fabs(cmdLinVel)<lin_vel_dead_zone) {
+				cmdAngVel = ang_vel_dead_zone;
+			} else if (fabs(cmdLinVel)>0 && fabs(cmdLinVel)<lin_vel_dead_zone && fabs(cmdAngVel)<ang_vel_dead_zone) {
+				cmdLinVel = lin_vel_dead_zone;
+			} 
 		}
 	}
+
+	if (velocity_ramp) { // Streamed by the ramp thread
+		target_linear = std::min(std::max(cmdLinVel,-MAX_LINEAR_VELOCITY),MAX_LINEAR_VELOCITY);
+		target_angular = std::min(std::max(cmdAngVel,-MAX_ANGULAR_VELOCITY),MAX_ANGULAR_VELOCITY);
+		ramp_active = true;
+	} else {
+		prepareVelocity(cmdLinVel,cmdAngVel,command);
+	}
 }
 
-// StalkRef callback function
+// Prepare a velocity with the configured calibration, none if the speed controllers send it
+// @precondition ramp_mutex should be locked
 inline
-void Node::stalkRefReceived(const teresa_driver::StalkRef::ConstPtr& stalk_ref)
-{ 
-	teresa->setHeight((int)std::round(stalk_ref->head_height*1000)); // From meters to millimeters
-        teresa->setTilt((int)std::round(stalk_ref->head_tilt * 57.2958)); // From radians to degrees
+void Node::prepareVelocity(double linear, double angular, MotorCommand& command)
+{
+	if (speed_control) { // Sent by controlWheelSpeeds() with the next encoder sample
+		linear = std::min(std::max(linear,-MAX_LINEAR_VELOCITY),MAX_LINEAR_VELOCITY);
+		angular = std::min(std::max(angular,-MAX_ANGULAR_VELOCITY),MAX_ANGULAR_VELOCITY);
+		left_wheel_ref = std::min(std::max(linear - ROBOT_RADIUS_M*angular,-MAX_LINEAR_VELOCITY),MAX_LINEAR_VELOCITY);
+		right_wheel_ref = std::min(std::max(linear + ROBOT_RADIUS_M*angular,-MAX_LINEAR_VELOCITY),MAX_LINEAR_VELOCITY);
+		if (std::abs(left_wheel_ref) <= LINEAR_VELOCITY_ZERO_THRESHOLD &&
+			std::abs(right_wheel_ref) <= LINEAR_VELOCITY_ZERO_THRESHOLD) {
+			left_controller.reset(); // Exact stop, the controllers start again from zero
+			right_controller.reset();
+			speed_control_active = false;
+			prepareRaw(0,0,command);
+		} else {
+			speed_control_active = true;
+		}
+		return;
+	}
+	command.type = use_upo_calib ? MotorCommand::VELOCITY2 : MotorCommand::VELOCITY;
+	command.linear = linear;
+	command.angular = angular;
+	command.sequence = ++command_sequence;
 }
 
-// CmdVel callback function
+// Prepare raw motor units
+// @precondition ramp_mutex should be locked
 inline
-void Node::cmdVelReceived(const geometry_msgs::Twist::ConstPtr& cmd_vel)
-{ 
-	cmd_vel_time = ros::Time::now(); // Get the time
-	if (!imu_error) { // If IMU error, do not move!
-		double cmdLinVel = cmd_vel->linear.x;
-		double cmdAngVel = cmd_vel->angular.z;
-
-		if(deadZoneIsActive) {
-			//if robot is (almost) stopped
-			if(fabs(lin_vel) < lin_vel_zero_threshold && fabs(ang_vel) < ang_vel_zero_threshold)
-			{
-				if (fabs(cmdAngVel)>0 && fabs(cmdAngVel)<ang_vel_dead_zone && fabs(cmdLinVel)<lin_vel_dead_zone) {
-					cmdAngVel = ang_vel_dead_zone;
-				} else if (fabs(cmdLinVel)>0 && fabs(cmdLinVel)<lin_vel_dead_zone && fabs(cmdAngVel)<ang_vel_dead_zone) {
-					cmdLinVel = lin_vel_dead_zone;
-				} 
+void Node::prepareRaw(int16_t left, int16_t right, MotorCommand& command)
+{
+	command.type = MotorCommand::RAW;
+	command.left = left;
+	command.right = right;
+	command.sequence = ++command_sequence;
+}
+
+// Send a prepared command. The commands are prepared in order under ramp_mutex but sent
+// after releasing it, so a command older than the last one sent or than the last stop is
+// dropped, and one that was being sent when a stop went ahead is followed by another stop.
+inline
+void Node::sendMotorCommand(const MotorCommand& command)
+{
+	if (command.type == MotorCommand::NONE) {
+		return;
+	}
+	boost::lock_guard<boost::mutex> lock(send_mutex);
+	if (command.sequence < sent_sequence || command.sequence < stop_sequence) {
+		return;
+	}
+	if (command.type == MotorCommand::VELOCITY) {
+		teresa->setVelocity(command.linear,command.angular);
+	} else if (command.type == MotorCommand::VELOCITY2) {
+		teresa->setVelocity2(command.linear,command.angular);
+	} else {
+		teresa->setVelocityRaw(command.left,command.right);
+	}
+	sent_sequence = command.sequence;
+	if (command.sequence < stop_sequence) {
+		teresa->stop();
+	}
+}
+
+// Raise an atomic sequence, it never goes back
+inline
+void Node::raiseSequence(boost::atomic<unsigned long>& value, unsigned long sequence)
+{
+	unsigned long current = value.load();
+	while (current < sequence && !value.compare_exchange_weak(current,sequence)) {
+	}
+}
+
+// Stop the wheels right now through the priority path of the robot, before taking any lock
+// of the node, and then restart the ramp, the trajectory and the speed control from zero.
+// A command prepared before the reset and sent after the first stop gets a second one.
+inline
+void Node::stopRobot()
+{
+	unsigned long sequence = ++command_sequence;
+	raiseSequence(stop_sequence,sequence);
+	teresa->stop();
+	{
+		boost::lock_guard<boost::mutex> lock(ramp_mutex);
+		resetCommands();
+		raiseSequence(stop_sequence,++command_sequence);
+	}
+	if (sent_sequence > sequence) {
+		teresa->stop();
+	}
+}
+
+// Drop the ramp, the trajectory and the speed control, so the next command starts from zero
+// @precondition ramp_mutex should be locked
+inline
+void Node::resetCommands()
+{
+	linear_ramp.reset(0);
+	angular_ramp.reset(0);
+	target_linear = 0;
+	target_angular = 0;
+	ramp_active = false;
+	trajectory.clear();
+	left_controller.reset();
+	right_controller.reset();
+	left_wheel_ref = 0;
+	right_wheel_ref = 0;
+	speed_control_active = false;
+}
+
+// Open-loop motor units of a wheel speed, with the calibration table of setVelocity()
+inline
+double Node::feedforward(double velocity, const utils::CalibrationTable& table)
+{
+	if (std::abs(velocity) <= LINEAR_VELOCITY_ZERO_THRESHOLD) {
+		return 0;
+	}
+	return table.getUnits(velocity);
+}
+
+// Run the wheel speed controllers with the wheel speeds of the last encoder sample
+inline
+void Node::controlWheelSpeeds()
+{
+	odom_mutex.lock();
+	double stamp = odom_stamp;
+	double left_vel = left_wheel_vel;
+	double right_vel = right_wheel_vel;
+	odom_mutex.unlock();
+	MotorCommand command;
+	{
+		boost::lock_guard<boost::mutex> lock(ramp_mutex);
+		double dt = stamp - speed_control_stamp;
+		speed_control_stamp = stamp;
+		if (!speed_control_active || dt <= 0 || dt > 0.5) { // Not a fresh sample
+			return;
+		}
+		double left_output = left_controller.update(left_wheel_ref,left_vel,
+					feedforward(left_wheel_ref,calibration.left_table),dt);
+		double right_output = right_controller.update(right_wheel_ref,right_vel,
+					feedforward(right_wheel_ref,calibration.right_table),dt);
+		prepareRaw((int16_t)std::round(calibration.inverse_left_motor ? -left_output : left_output),
+			(int16_t)std::round(calibration.inverse_right_motor ? -right_output : right_output),command);
+		if (speed_control_pub) {
+			speed_control_msg.left_reference = left_wheel_ref;
+			speed_control_msg.right_reference = right_wheel_ref;
+			speed_control_msg.left_error = left_controller.getError();
+			speed_control_msg.right_error = right_controller.getError();
+		}
+	}
+	sendMotorCommand(command);
+	if (!speed_control_pub) {
+		return;
+	}
+	speed_control_msg.header.stamp = toRosTime(stamp);
+	speed_control_msg.left_velocity = left_vel;
+	speed_control_msg.right_velocity = right_vel;
+	speed_control_msg.left_output = command.left;
+	speed_control_msg.right_output = command.right;
+	speed_control_msg.latency = utils::monotonicNow() - stamp;
+	speed_control_pub.publish(speed_control_msg);
+}
+
+// Add the last encoder sample to the online calibration. It runs with the odometry, so it does
+// not allocate nor wait for the boards
+inline
+void Node::updateCalibrationEstimate()
+{
+	odom_mutex.lock();
+	double stamp = odom_stamp;
+	double left_vel = left_wheel_vel;
+	double right_vel = right_wheel_vel;
+	odom_mutex.unlock();
+	int16_t left_units,right_units;
+	teresa->getMotorUnits(left_units,right_units);
+	boost::lock_guard<boost::mutex> lock(calibration_mutex);
+	addCalibrationSample(left_rls,left_units,calibration.inverse_left_motor,left_vel,stamp,
+				left_steady_units,left_steady_since);
+	addCalibrationSample(right_rls,right_units,calibration.inverse_right_motor,right_vel,stamp,
+				right_steady_units,right_steady_since);
+}
+
+// Publish the estimates of the online calibration every online_calibration_period seconds, and
+// apply them if online_calibration_apply. It runs in the main loop, since the tables are
+// allocated and setCalibration() waits for the motors board
+inline
+void Node::publishCalibrationEstimate(double now)
+{
+	if (now - online_calibration_time < online_calibration_period) {
+		return;
+	}
+	online_calibration_time = now;
+	calibration_mutex.lock();
+	calibration_msg.A_left = left_rls.getSlope();
+	calibration_msg.B_left = left_rls.getOffset();
+	calibration_msg.A_right = right_rls.getSlope();
+	calibration_msg.B_right = right_rls.getOffset();
+	calibration_msg.left_samples = left_rls.getSamples();
+	calibration_msg.right_samples = right_rls.getSamples();
+	calibration_msg.left_rms = left_rls.getRms();
+	calibration_msg.right_rms = right_rls.getRms();
+	calibration_mutex.unlock();
+	bool apply = online_calibration_apply && 
+			calibration_msg.left_samples >= (unsigned long)online_calibration_min_samples &&
+			calibration_msg.right_samples >= (unsigned long)online_calibration_min_samples;
+	if (apply) { // The tables are rebuilt out of the locks
+		Calibration estimate = calibration;
+		estimate.A_left = calibration_msg.A_left;
+		estimate.B_left = calibration_msg.B_left;
+		estimate.A_right = calibration_msg.A_right;
+		estimate.B_right = calibration_msg.B_right;
+		std::string error;
+		if (initCalibrationTables(estimate,"",error)) {
+			// Only the tables of the estimated model change
+			if (online_calibration_upo) {
+				estimate.left_table = calibration.left_table;
+				estimate.right_table = calibration.right_table;
+			} else {
+				estimate.left_upo_table = calibration.left_upo_table;
+				estimate.right_upo_table = calibration.right_upo_table;
 			}
+			ramp_mutex.lock(); // Field by field, the odometry thread reads the motor inversion
+			calibration.A_left = estimate.A_left;
+			calibration.B_left = estimate.B_left;
+			calibration.A_right = estimate.A_right;
+			calibration.B_right = estimate.B_right;
+			calibration.left_table = estimate.left_table;
+			calibration.right_table = estimate.right_table;
+			calibration.left_upo_table = estimate.left_upo_table;
+			calibration.right_upo_table = estimate.right_upo_table;
+			ramp_mutex.unlock();
+			apply = teresa->setCalibration(estimate); // It waits for the motors board
+		} else {
+			ROS_WARN("Online calibration not applied: %s",error.c_str());
+			apply = false;
 		}
+	}
+	calibration_msg.header.stamp = ros::Time::now();
+	calibration_msg.applied = apply;
+	calibration_pub.publish(calibration_msg);
+}
+
+// Add a sample of a wheel if its command has been steady for online_calibration_settle_time
+// and the wheel moves in the commanded direction
+inline
+void Node::addCalibrationSample(utils::LinearRls& rls, int16_t units, bool inverse, double velocity, double stamp,
+				int16_t& steady_units, double& steady_since)
+{
+	if (std::abs(units - steady_units) > 1) { // A new command
+		steady_units = units;
+		steady_since = stamp;
+		return;
+	}
+	double forward_units = inverse ? -units : units;
+	if (units == 0 || stamp - steady_since < online_calibration_settle_time ||
+		std::abs(velocity) < online_calibration_min_velocity || (forward_units > 0) != (velocity > 0)) {
+		return;
+	}
+	if (online_calibration_upo) {
+		rls.update(velocity,forward_units);
+	} else {
+		rls.update(std::abs(velocity),std::abs(forward_units));
+	}
+}
 
-		if(use_upo_calib)
-			teresa->setVelocity2( cmdLinVel, cmdAngVel);
-		else
-			teresa->setVelocity( cmdLinVel, cmdAngVel);
+// Mux input callback function, the command is forwarded only if its source wins
+inline
+void Node::muxReceived(const geometry_msgs::Twist::ConstPtr& cmd_vel, int input)
+{
+	int previous = mux.getActive();
+	if (!mux.accept(input,utils::monotonicNow())) {
+		return;
 	}
+	if (input != previous) {
+		ROS_INFO("Velocity command source: %s",mux.getInput(input).topic.c_str());
+	}
+	cmdVelReceived(cmd_vel);
 }
 
 // CmdVelRaw callback function
 inline
 void Node::cmdVelRawReceived(const teresa_driver::CmdVelRaw::ConstPtr& vel_ref)
 {
-	teresa->setVelocityRaw(vel_ref->left_wheel, vel_ref->right_wheel);
+	cmd_vel_steady_time = utils::monotonicNow(); // Raw commands are kept alive by their own messages, as /cmd_vel
+	idle = false;
+	MotorCommand command;
+	{
+		boost::lock_guard<boost::mutex> lock(ramp_mutex);
+		resetCommands(); // Raw commands are not ramped nor controlled, the next command starts from zero
+		prepareRaw(vel_ref->left_wheel, vel_ref->right_wheel, command);
+	}
+	sendMotorCommand(command);
+}
+
+// Trajectory callback function, it replaces the current trajectory
+inline
+void Node::trajectoryReceived(const teresa_driver::VelocityTrajectory::ConstPtr& msg)
+{
+	unsigned size = msg->time_from_start.size();
+	if (msg->linear.size()!=size || msg->angular.size()!=size) {
+		ROS_WARN("Velocity trajectory ignored: the arrays have different sizes");
+		return;
+	}
+	for (unsigned i=1;i<size;i++) {
+		if (!(msg->time_from_start[i] >= msg->time_from_start[i-1])) {
+			ROS_WARN("Velocity trajectory ignored: the setpoints are not in time order");
+			return;
+		}
+	}
+	double now = utils::monotonicNow();
+	double start = now;
+	if (!msg->header.stamp.isZero()) {
+		start -= (ros::Time::now() - msg->header.stamp).toSec();
+	}
+	// The command timeout stops the robot and drops the trajectory, so it must not wait 0.5 seconds for a setpoint
+	if (size > 0 && start + msg->time_from_start[0] - now >= 0.5) {
+		ROS_WARN("Velocity trajectory ignored: the first setpoint is 0.5 seconds or more in the future");
+		return;
+	}
+	for (unsigned i=1;i<size;i++) {
+		if (msg->time_from_start[i] - msg->time_from_start[i-1] >= 0.5) {
+			ROS_WARN("Velocity trajectory ignored: there are 0.5 seconds or more between two setpoints");
+			return;
+		}
+	}
+	cmd_vel_steady_time = now;
+	idle = false;
+	boost::lock_guard<boost::mutex> lock(ramp_mutex);
+	std::vector<utils::VelocitySetpoint>& setpoints = trajectory.prepare();
+	for (unsigned i=0;i<size;i++) {
+		utils::VelocitySetpoint setpoint;
+		setpoint.time = start + msg->time_from_start[i];
+		setpoint.linear = msg->linear[i];
+		setpoint.angular = msg->angular[i];
+		setpoints.push_back(setpoint);
+	}
+	trajectory.commit();
+	armTrajectoryTimer(trajectory.getNextTime());
+}
+
+// Wake up the trajectory thread at a CLOCK_MONOTONIC time, or never if it is infinity
+inline
+void Node::armTrajectoryTimer(double time)
+{
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = 0;
+	spec.it_interval.tv_nsec = 0;
+	if (time == std::numeric_limits<double>::infinity()) {
+		spec.it_value = spec.it_interval; // Disarm
+	} else {
+		int64_t ns = std::max((int64_t)(time*1e9),(int64_t)1); // Zero would disarm it
+		spec.it_value.tv_sec = ns / 1000000000LL;
+		spec.it_value.tv_nsec = ns % 1000000000LL;
+	}
+	timerfd_settime(trajectory_fd,TFD_TIMER_ABSTIME,&spec,NULL);
 }
 
 
@@ -410,209 +1232,714 @@ bool Node::teresaLeds(teresa_driver::Teresa_leds::Request &req,
 	return true;
 }
 
+// Pose service, the odometry interpolated at the requested time
+inline
+bool Node::getPose(teresa_driver::Get_pose::Request &req,
+			teresa_driver::Get_pose::Response &res)
+{
+	utils::PoseSample sample;
+	odom_mutex.lock();
+	res.success = pose_history.getPose(req.stamp.toSec(),sample);
+	odom_mutex.unlock();
+	if (!res.success) {
+		return true;
+	}
+	res.odom.header.stamp = req.stamp;
+	res.odom.header.frame_id = odom_frame_id;
+	res.odom.child_frame_id = base_frame_id;
+	res.odom.pose.pose.position.x = sample.x;
+	res.odom.pose.pose.position.y = sample.y;
+	res.odom.pose.pose.position.z = 0.0;
+	res.odom.pose.pose.orientation = tf::createQuaternionMsgFromYaw(sample.yaw);
+	res.odom.twist.twist.linear.x = sample.lin_vel;
+	res.odom.twist.twist.angular.z = sample.ang_vel;
+	return true;
+}
+
+// Run an optional stage of the main loop
+inline
+void Node::runStage(int stage)
+{
+	switch (stage) {
+		case STAGE_BUTTONS:     publishButtons(); break;
+		case STAGE_VOLUME:      publishVolume(); break;
+		case STAGE_BATTERIES:   publishBatteries(); break;
+		case STAGE_TEMPERATURE: publishTemperature(); break;
+		case STAGE_DIAGNOSTICS: publishDiagnostics(); break;
+		case STAGE_LEDS:        updateLeds(); break;
+	}
+}
+
+//publish the state of the buttons
+inline
+void Node::publishButtons()
+{
+	bool button1_tmp,button2_tmp;
+	double stamp;
+	if (publish_buttons &&	teresa->getButtons(button1_tmp,button2_tmp,stamp) && 
+		(buttons_first_time || button1!=button1_tmp || button2!=button2_tmp)) {
+		button1 = button1_tmp;
+		button2 = button2_tmp;
+		buttons_first_time = false;
+		buttons_msg.header.stamp = toRosTime(stamp);
+		buttons_msg.button1=button1;
+		buttons_msg.button2=button2;
+		buttons_pub.publish(buttons_msg);
+	}
+}
+
+//publish the state of the rotaryEncoder
+inline
+void Node::publishVolume()
+{
+	int rotaryEncoder;
+	double stamp;
+	if (publish_volume && teresa->getRotaryEncoder(rotaryEncoder,stamp) && rotaryEncoder!=0) {
+		volume_msg.header.stamp = toRosTime(stamp);
+		volume_msg.volume_inc=rotaryEncoder;
+		volume_pub.publish(volume_msg);
+	}
+}
+
+//publish the state of the batteries
+inline
+void Node::publishBatteries()
+{
+	unsigned char elec_level, PC1_level, motorH_level, motorL_level, charger_status;
+	double stamp;
+	if (teresa->getBatteryStatus(elec_level,PC1_level,motorH_level,motorL_level,charger_status,stamp)) {
+		batteries_msg.header.stamp = toRosTime(stamp);
+		batteries_msg.elec_level = elec_level;
+		batteries_msg.PC1_level = PC1_level;
+		batteries_msg.motorH_level = motorH_level;
+		batteries_msg.motorL_level = motorL_level;
+		batteries_msg.charger_status = charger_status;
+		batteries_pub.publish(batteries_msg);	
+	}
+}
+
+//publish the temperatures
+inline
+void Node::publishTemperature()
+{
+	int temperature_left_motor,temperature_right_motor,temperature_left_driver,temperature_right_driver;
+	bool tilt_overheat,height_overheat;
+	double stamp;
+	if (publish_temperature &&
+		teresa->getTemperature(temperature_left_motor,
+					temperature_right_motor,
+					temperature_left_driver,
+					temperature_right_driver,
+					tilt_overheat,
+					height_overheat,
+					stamp)) {
+		temperature_msg.header.stamp = toRosTime(stamp);
+		temperature_msg.left_motor_temperature = temperature_left_motor;
+		temperature_msg.right_motor_temperature = temperature_right_motor;
+		temperature_msg.left_driver_temperature = temperature_left_driver;
+		temperature_msg.right_driver_temperature = temperature_right_driver;
+		temperature_msg.tilt_driver_overheat = tilt_overheat;
+		temperature_msg.height_driver_overheat = height_overheat;
+		temperature_pub.publish(temperature_msg);
+	}
+}
+
+//publish diagnostics
+inline
+void Node::publishDiagnostics()
+{
+	PowerDiagnostics diagnostics;
+	double stamp;
+	if (publish_diagnostics && teresa->getPowerDiagnostics(diagnostics,stamp)) {
+		diagnostics_msg.header.stamp = toRosTime(stamp);
+		diagnostics_msg.elec_bat_voltage = diagnostics.elec_bat_voltage;
+		diagnostics_msg.PC1_bat_voltage = diagnostics.PC1_bat_voltage;
+		diagnostics_msg.cable_bat_voltage = diagnostics.cable_bat_voltage;
+		diagnostics_msg.motor_voltage = diagnostics.motor_voltage;
+		diagnostics_msg.motor_h_voltage = diagnostics.motor_h_voltage;
+		diagnostics_msg.motor_l_voltage = diagnostics.motor_l_voltage;
+		diagnostics_msg.elec_instant_current = diagnostics.elec_instant_current;
+		diagnostics_msg.motor_instant_current = diagnostics.motor_instant_current;
+		diagnostics_msg.elec_integrated_current = diagnostics.elec_integrated_current;
+		diagnostics_msg.motor_integrated_current = diagnostics.motor_integrated_current;
+		diagnostics_msg.average_loop_freq = 1.0 / (loopDurationSum/(double)loopCounter);
+		for (int i=0;i<stages.size();i++) {
+			diagnostics_msg.stage_shed_counts[i] = stages.getShedCount(i);
+		}
+		diagnostics_msg.emergency_stop = teresa->isEmergencyStopped();
+		diagnostics_msg.emergency_stop_max_latency = emergency_stop_max_latency * 1000.0;
+		diagnostics_pub.publish(diagnostics_msg);
+	}
+}
+
+// Leds Pattern
+inline
+void Node::updateLeds()
+{
+	if (leds!=NULL) {
+		teresa->setLeds(leds->getLeds());
+		leds->update();
+	}
+}
+
+// Set the period of the idle or normal mode, the phase restarts if it changes
+inline
+bool Node::updateLoopPeriod(utils::PeriodicTimer& timer)
+{
+	double period = idle ? 1.0/idle_freq : 1.0/freq;
+	if (period == timer.getPeriod()) {
+		return false;
+	}
+	timer.setPeriod(period);
+	timer.start();
+	return true;
+}
+
+// Publish the timing of the main loop
+inline
+void Node::publishLoopTiming(const ros::Time& current_time, const utils::PeriodicTimer& timer)
+{
+	int sections = profiler.size();
+	loop_timing_msg.header.stamp = current_time;
+	for (int i=0;i<sections;i++) {
+		utils::DurationStats stats = profiler.getStats(i);
+		loop_timing_msg.section_p50[i] = stats.p50 * 1000.0;
+		loop_timing_msg.section_p99[i] = stats.p99 * 1000.0;
+		loop_timing_msg.section_max[i] = stats.max * 1000.0;
+	}
+	double mean,jitter;
+	profiler.getPeriodJitter(mean,jitter);
+	utils::DurationStats period = profiler.getPeriodStats();
+	loop_timing_msg.period_mean = mean * 1000.0;
+	loop_timing_msg.period_jitter = jitter * 1000.0;
+	loop_timing_msg.period_p99 = period.p99 * 1000.0;
+	loop_timing_msg.period_max = period.max * 1000.0;
+	loop_timing_msg.overruns = timer.overruns();
+	loop_timing_msg.missed_deadlines = timer.missed();
+	loop_timing_pub.publish(loop_timing_msg);
+}
+
+// Allocate the reused messages and set their constant fields
+inline
+void Node::initMessages()
+{
+	transforms.resize(odometry_freq <= 0 ? 3 : 2); // The odometry transform is sent here if sampled in the main loop
+	transforms[TF_STALK].header.frame_id = base_frame_id;
+	transforms[TF_STALK].child_frame_id = stalk_frame_id;
+	transforms[TF_STALK].transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, 0.0);
+	transforms[TF_HEAD].header.frame_id = stalk_frame_id;
+	transforms[TF_HEAD].child_frame_id = head_frame_id;
+	transforms[TF_HEAD].transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, 0.0);
+	odom_trans.header.frame_id = odom_frame_id;
+	odom_trans.child_frame_id = base_frame_id;
+	odom_trans.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, 0.0);
+	if (odometry_freq <= 0) {
+		transforms[TF_ODOM] = odom_trans;
+	}
+	odom_msg.header.frame_id = odom_frame_id;
+	odom_msg.child_frame_id = base_frame_id;
+	odom_msg.pose.pose.orientation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, 0.0);
+	diagnostics_msg.stage_names.resize(stages.size());
+	diagnostics_msg.stage_shed_counts.resize(stages.size());
+	for (int i=0;i<stages.size();i++) {
+		diagnostics_msg.stage_names[i] = stages.getName(i);
+	}
+	int sections = profiler.size();
+	loop_timing_msg.section_names.resize(sections);
+	loop_timing_msg.section_p50.resize(sections);
+	loop_timing_msg.section_p99.resize(sections);
+	loop_timing_msg.section_max.resize(sections);
+	for (int i=0;i<sections;i++) {
+		loop_timing_msg.section_names[i] = profiler.getName(i);
+	}
+}
+
+// From CLOCK_MONOTONIC to ROS time
+inline
+ros::Time Node::toRosTime(double stamp)
+{
+	return ros::Time::now() - ros::Duration(utils::monotonicNow() - stamp);
+}
+
+// Integrate the pose with the ticks of each wheel until the sample time.
+// The robot is assumed to move along a circular arc between two samples, so
+// the pose is exact for constant wheel velocities however long the interval is.
+inline
+void Node::updateOdometry(int64_t left_ticks, int64_t right_ticks, double stamp)
+{
+	boost::lock_guard<boost::mutex> lock(odom_mutex);
+	if (velocity_filter) {
+		left_velocity.update((double)left_ticks * METERS_PER_TICK, stamp);
+		right_velocity.update((double)right_ticks * METERS_PER_TICK, stamp);
+	}
+	double dt = stamp - odom_stamp;
+	if (odom_stamp == 0 || dt <= 0) { // The first sample only sets the origin
+		odom_stamp = stamp;
+		odom_left_ticks = left_ticks;
+		odom_right_ticks = right_ticks;
+		return;
+	}
+	double imdl = (double)(left_ticks - odom_left_ticks) * METERS_PER_TICK;
+	double imdr = (double)(right_ticks - odom_right_ticks) * METERS_PER_TICK;
+	double inc_yaw;
+	if (using_imu) {
+		inc_yaw = imu_rates.integrate(odom_stamp,stamp);
+	} else {
+		inc_yaw = (imdr-imdl)/ROBOT_DIAMETER_M;
+	}
+	odom_stamp = stamp;
+	odom_left_ticks = left_ticks;
+	odom_right_ticks = right_ticks;
+	double imd = (imdl+imdr)/2;
+	if (velocity_filter) {
+		// The IMU rate is not quantized, it is used as it is
+		left_wheel_vel = left_velocity.getVelocity();
+		right_wheel_vel = right_velocity.getVelocity();
+		lin_vel = (left_wheel_vel+right_wheel_vel)/2;
+		ang_vel = using_imu ? inc_yaw/dt : (right_wheel_vel-left_wheel_vel)/ROBOT_DIAMETER_M;
+	} else {
+		left_wheel_vel = imdl / dt;
+		right_wheel_vel = imdr / dt;
+		lin_vel = imd / dt;
+		ang_vel = inc_yaw/dt;
+	}
+	if (std::abs(inc_yaw) < 1e-6) {
+		pos_x += imd*std::cos(yaw + inc_yaw/2);
+		pos_y += imd*std::sin(yaw + inc_yaw/2);
+	} else {
+		double radius = imd/inc_yaw;
+		pos_x += radius*(std::sin(yaw + inc_yaw) - std::sin(yaw));
+		pos_y -= radius*(std::cos(yaw + inc_yaw) - std::cos(yaw));
+	}
+	yaw += inc_yaw;
+	utils::PoseSample sample;
+	sample.stamp = toRosTime(stamp).toSec();
+	sample.x = pos_x;
+	sample.y = pos_y;
+	sample.yaw = yaw;
+	sample.lin_vel = lin_vel;
+	sample.ang_vel = ang_vel;
+	pose_history.add(sample);
+	shared_odometry.write(sample);
+}
+
+// Fill the odometry transform, its frame ids are set by initMessages().
+// It returns false until the first encoder sample, there is no pose to stamp before it
+inline
+bool Node::updateOdometryTF(geometry_msgs::TransformStamped& transform)
+{
+	odom_mutex.lock();
+	if (odom_stamp == 0) {
+		odom_mutex.unlock();
+		return false;
+	}
+	transform.header.stamp = toRosTime(odom_stamp);
+	transform.transform.translation.x = pos_x;
+	transform.transform.translation.y = pos_y;
+	double yaw = Node::yaw;
+	odom_mutex.unlock();
+	transform.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, yaw);
+	return true;
+}
+
+// Publish the odometry message over ROS
+inline
+void Node::publishOdometry()
+{
+	odom_mutex.lock();
+	if (odom_stamp == 0) { // No encoder sample yet
+		odom_mutex.unlock();
+		return;
+	}
+	odom_msg.header.stamp = toRosTime(odom_stamp);
+	//set the position
+	odom_msg.pose.pose.position.x = pos_x;
+	odom_msg.pose.pose.position.y = pos_y;
+	double yaw = Node::yaw;
+	//set the velocity
+	odom_msg.twist.twist.linear.x = lin_vel;
+	odom_msg.twist.twist.angular.z = ang_vel;
+	odom_mutex.unlock();
+	odom_msg.pose.pose.orientation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, yaw);
+	//publish the odometry
+	odom_pub.publish(odom_msg);
+}
+
+// Odometry loop, samples the encoders at odometry_freq and publishes /odom and TF at their own rates
+inline
+void Node::odometryLoop()
+{
+	utils::configureRealtimeThread(realtime,"odometry",false,printInfo,printError);
+	utils::PeriodicTimer r(1.0/odometry_freq);
+	int64_t left_ticks,right_ticks;
+	double stamp;
+	double last_publish_time = 0;
+	double last_tf_time = 0;
+	while (n.ok()) {
+		if (teresa->getTicks(left_ticks,right_ticks,stamp)) {
+			updateOdometry(left_ticks,right_ticks,stamp);
+			if (speed_control) {
+				controlWheelSpeeds();
+			}
+			if (online_calibration) {
+				updateCalibrationEstimate();
+			}
+		}
+		double now = utils::monotonicNow();
+		if (now - last_tf_time >= 1.0/odometry_tf_freq) {
+			if (updateOdometryTF(odom_trans)) {
+				tf_broadcaster.sendTransform(odom_trans);
+			}
+			last_tf_time = now;
+		}
+		if (now - last_publish_time >= 1.0/odometry_publish_freq) {
+			publishOdometry();
+			last_publish_time = now;
+		}
+		r.sleep();
+	}
+}
+
+// Watchdog loop, woken up by a timerfd at watchdog_freq. Its stop takes the priority lock of
+// the motors board before any lock of the node, so it is the next transaction on the board
+inline
+void Node::watchdogLoop()
+{
+	utils::RealtimeConfig config = realtime;
+	config.priority = std::min(realtime.priority + 1, sched_get_priority_max(SCHED_FIFO));
+	utils::configureRealtimeThread(config,"watchdog",false,printInfo,printError);
+	int fd = timerfd_create(CLOCK_MONOTONIC,0);
+	if (fd==-1) {
+		ROS_ERROR("Cannot create the watchdog timer: %s",strerror(errno));
+		return;
+	}
+	struct itimerspec spec;
+	long period = (long)(1e9/watchdog_freq);
+	spec.it_interval.tv_sec = period / 1000000000L;
+	spec.it_interval.tv_nsec = period % 1000000000L;
+	spec.it_value = spec.it_interval;
+	timerfd_settime(fd,0,&spec,NULL);
+	bool stopped = false; // Stopped by the watchdog, only once until everything is fresh again
+	uint64_t expirations;
+	while (n.ok()) {
+		if (read(fd,&expirations,sizeof(expirations)) != sizeof(expirations)) {
+			continue;
+		}
+		double now = utils::monotonicNow();
+		bool cmd_vel_timeout = now - cmd_vel_steady_time >= 0.5; // The normal way of stopping
+		bool imu_timeout = using_imu && now - imu_steady_time >= 0.25;
+		bool loop_timeout = now - loop_steady_time >= watchdog_loop_timeout;
+		if (!cmd_vel_timeout && !imu_timeout && !loop_timeout) {
+			stopped = false;
+		} else if (!stopped) {
+			stopRobot(); // The priority stop goes first, then the ramp and the trajectory are reset
+			stopped = true;
+			if (imu_timeout) {
+				ROS_WARN("Watchdog stop: no IMU data");
+			} else if (loop_timeout) {
+				ROS_WARN("Watchdog stop: main loop stalled");
+			}
+		}
+	}
+	close(fd);
+}
+
+// Emergency stop loop, it serves only the emergency stop callbacks with the priority of the watchdog
+inline
+void Node::emergencyStopLoop()
+{
+	utils::RealtimeConfig config = realtime;
+	config.priority = std::min(realtime.priority + 1, sched_get_priority_max(SCHED_FIFO));
+	utils::configureRealtimeThread(config,"emergency stop",false,printInfo,printError);
+	while (n.ok()) {
+		emergency_stop_queue.callAvailable(ros::WallDuration(0.1));
+	}
+}
+
+// Ramp loop, it streams the acceleration and jerk limited velocities at ramp_freq until
+// the ramp settles at zero
+inline
+void Node::rampLoop()
+{
+	utils::configureRealtimeThread(realtime,"ramp",false,printInfo,printError);
+	utils::PeriodicTimer r(1.0/ramp_freq);
+	double last_time = utils::monotonicNow();
+	while (n.ok()) {
+		r.sleep();
+		double now = utils::monotonicNow();
+		double dt = now - last_time;
+		last_time = now;
+		MotorCommand command;
+		{
+			boost::lock_guard<boost::mutex> lock(ramp_mutex);
+			if (!ramp_active) {
+				continue;
+			}
+			double linear = linear_ramp.update(target_linear,dt);
+			double angular = angular_ramp.update(target_angular,dt);
+			ramp_active = target_linear != 0 || target_angular != 0 ||
+					!linear_ramp.isSettled(0) || !angular_ramp.isSettled(0);
+			prepareVelocity(linear,angular,command);
+		}
+		sendMotorCommand(command);
+	}
+}
+
+// Trajectory loop, it sends each setpoint when its timer expires. The poll timeout
+// only checks the shutdown.
+inline
+void Node::trajectoryLoop()
+{
+	utils::configureRealtimeThread(realtime,"trajectory",false,printInfo,printError);
+	struct pollfd pfd;
+	pfd.fd = trajectory_fd;
+	pfd.events = POLLIN;
+	uint64_t expirations;
+	while (n.ok()) {
+		if (poll(&pfd,1,100) <= 0 || read(trajectory_fd,&expirations,sizeof(expirations)) != sizeof(expirations)) {
+			continue;
+		}
+		double now = utils::monotonicNow();
+		utils::VelocitySetpoint setpoint;
+		MotorCommand command;
+		{
+			boost::lock_guard<boost::mutex> lock(ramp_mutex);
+			if (trajectory.pop(now,setpoint)) {
+				cmd_vel_steady_time = now;
+				idle = false;
+				if (!imu_error) {
+					prepareCommand(setpoint.linear,setpoint.angular,command);
+				}
+			}
+			armTrajectoryTimer(trajectory.getNextTime());
+		}
+		sendMotorCommand(command);
+	}
+	close(trajectory_fd);
+}
+
+// Emergency stop callback function
+inline
+void Node::emergencyStopReceived(const teresa_driver::EmergencyStop::ConstPtr& estop)
+{
+	setEmergencyStop(estop->stop,estop->header.stamp.isZero() ? ros::Time::now() : estop->header.stamp);
+}
+
+// Emergency stop service
+inline
+bool Node::emergencyStop(teresa_driver::Emergency_stop::Request &req,
+			teresa_driver::Emergency_stop::Response &res)
+{
+	res.success = setEmergencyStop(req.stop,req.stamp.isZero() ? ros::Time::now() : req.stamp);
+	return true;
+}
+
+// Latch or clear the emergency stop, the latency is measured from the request time
+inline
+bool Node::setEmergencyStop(bool stop, const ros::Time& request_time)
+{
+	bool success = teresa->emergencyStop(stop);
+	if (!stop) {
+		// The commands start again from zero, they are not locked while latching
+		boost::lock_guard<boost::mutex> lock(ramp_mutex);
+		resetCommands();
+		ROS_INFO("Emergency stop cleared");
+		return success;
+	}
+	double latency = (ros::Time::now() - request_time).toSec();
+	if (latency > emergency_stop_max_latency) {
+		emergency_stop_max_latency = latency;
+	}
+	ROS_WARN("Emergency stop latched, latency %.1f ms (worst %.1f ms)",latency*1000.0,emergency_stop_max_latency*1000.0);
+	return success;
+}
+
 // Main Loop
 inline
 void Node::loop()
 {
 	
-	double pos_x=0.0;
-	double pos_y=0.0;
-	ros::Time current_time,last_time;
+	ros::Time current_time;
+	double current_steady_time; // CLOCK_MONOTONIC
 	if (using_imu) {
 		imu_time = ros::Time::now();
 	}
-	last_time = ros::Time::now();
-	cmd_vel_time = ros::Time::now();
-	ros::Rate r(freq);
-	tf::TransformBroadcaster tf_broadcaster;
-	double imdl,imdr;
-	double dt;
-	bool first_time=true;
+	current_steady_time = utils::monotonicNow();
+	cmd_vel_steady_time = current_steady_time;
+	utils::PeriodicTimer r(1.0/freq,overrun_policy);
+	int64_t left_ticks,right_ticks;
+	double stamp;
 	double height_in_meters=0;
-	int height_in_millimeters=0;
+	int height_in_millimeters=std::numeric_limits<int>::min(); // Unknown until the first reading
 	double tilt_in_radians=0;
-	int tilt_in_degrees=0;
-	bool button1=false,button2=false;
-	bool button1_tmp,button2_tmp;
-	int rotaryEncoder;
-	unsigned char elec_level, PC1_level, motorH_level, motorL_level, charger_status;
-	int temperature_left_motor,temperature_right_motor,temperature_left_driver,temperature_right_driver;
-	bool tilt_overheat,height_overheat;
-	PowerDiagnostics diagnostics;
-	double loopDurationSum=0;
-	unsigned long loopCounter=0;
+	int tilt_in_degrees=std::numeric_limits<int>::min();
+	double head_tf_time = 0; // When the head transforms were sent
+	bool odom_tf_ready = false; // Is there an odometry transform to send in the main loop?
+	bool cmd_vel_stopped = false; // Already stopped by the command timeout?
+	double head_read_time = 0; // When the head was read
+	head_active_until = current_steady_time + head_settle_time; // Read the initial head position
+	double stopped_since = current_steady_time; // When the robot stopped moving
+	double last_loop_timing = current_steady_time; // When the loop timing was published
 	while (n.ok()) {
 		current_time = ros::Time::now();
+		current_steady_time = utils::monotonicNow();
+		loop_steady_time = current_steady_time;
 		if (using_imu) {		
 			double imu_sec = (current_time - imu_time).toSec();
 			if(imu_sec >= 0.25){
-				teresa->setVelocity(0,0);
+				stopRobot();
+				odom_mutex.lock();
 				ang_vel = 0;
+				odom_mutex.unlock();
 				imu_error = true;
 				ROS_WARN("-_-_-_-_-_- IMU STOP -_-_-_-_-_- imu_sec=%.3f sec",imu_sec);
 			} else {
 				imu_error = false;
 			}
 		}
-		double cmd_vel_sec = (current_time - cmd_vel_time).toSec();
-		if (cmd_vel_sec >= 0.5) {
-			teresa->setVelocity(0,0);
-		}
-		teresa->getIMD(imdl,imdr);
-		dt = (current_time - last_time).toSec();
-		if (!using_imu) {
-			double vr = imdr/dt;
-			double vl = imdl/dt;
-			ang_vel = (vr-vl)/ROBOT_DIAMETER_M;
-			inc_yaw += ang_vel*dt;
-		}
-		last_time = current_time;
-		if (!first_time) {
-			double imd = (imdl+imdr)/2;
-			lin_vel = imd / dt;
-			pos_x += imd*std::cos(yaw + ang_vel*dt/2);
-			pos_y += imd*std::sin(yaw + ang_vel*dt/2);
-			yaw += inc_yaw;
-			inc_yaw = 0;
-		} 
-		// ******************************************************************************************
-		//first, we'll publish the transforms over tf
-		geometry_msgs::TransformStamped odom_trans;
-		odom_trans.header.stamp = current_time;
-		odom_trans.header.frame_id = odom_frame_id;
-		odom_trans.child_frame_id = base_frame_id;
-		odom_trans.transform.translation.x = pos_x;
-		odom_trans.transform.translation.y = pos_y;
-		odom_trans.transform.translation.z = 0.0;
-		odom_trans.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, yaw);
-		tf_broadcaster.sendTransform(odom_trans);
-		if (teresa->getHeight(height_in_millimeters)) {
-			//ROS_INFO("%d",height_in_millimeters);
-			height_in_meters= (double)height_in_millimeters * 0.001;
+		double cmd_vel_sec = current_steady_time - cmd_vel_steady_time;
+		if (cmd_vel_sec < 0.5) {
+			cmd_vel_stopped = false;
+		} else if (!cmd_vel_stopped) { // Once per timeout, as the watchdog, so a parked robot does not hold the board
+			stopRobot();
+			cmd_vel_stopped = true;
 		}
+		profiler.cycle(current_steady_time);
+		double section_start;
+		if (odometry_freq <= 0) { // Odometry sampled in the main loop
+			section_start = profiler.tic();
+			if (teresa->getTicks(left_ticks,right_ticks,stamp)) {
+				updateOdometry(left_ticks,right_ticks,stamp);
+				if (speed_control) {
+					controlWheelSpeeds();
+				}
+				if (online_calibration) {
+					updateCalibrationEstimate();
+				}
+			}
+			profiler.toc(SECTION_ODOMETRY_READ,section_start);
+			section_start = profiler.tic();
+			odom_tf_ready = updateOdometryTF(transforms[TF_ODOM]); // Sent with the head transforms
+			profiler.toc(SECTION_ODOMETRY_TF,section_start);
+			section_start = profiler.tic();
+			publishOdometry();
+			profiler.toc(SECTION_ODOMETRY_PUBLISH,section_start);
+		}
+		if (online_calibration) {
+			publishCalibrationEstimate(current_steady_time);
+		}
+		// Idle mode: stopped and without commands for a while
+		if (!teresa->isStopped() || cmd_vel_sec < 0.5) {
+			stopped_since = current_steady_time;
+			idle = false;
+		} else if (idle_mode && current_steady_time - stopped_since >= idle_timeout) {
+			idle = true;
+		}
+		// With change detection, the head is read only while a command may be moving it
+		section_start = profiler.tic();
+		ros::Time height_time = current_time;
+		ros::Time tilt_time = current_time;
+		bool head_changed = false;
+		bool head_moving = head_prediction && 
+			(height_model.isMoving(current_steady_time) || tilt_model.isMoving(current_steady_time));
+		if (head_moving) {
+			head_active_until = std::max(head_active_until, current_steady_time + head_settle_time);
+		}
+		bool head_active = !head_change_detection || heightMotor!=MOTOR_STOP || tiltMotor!=MOTOR_STOP ||
+			current_steady_time < head_active_until;
+		if (head_active && (!head_prediction || current_steady_time - head_read_time >= 1.0/head_poll_freq)) {
+			int height_tmp,tilt_tmp;
+			head_read_time = current_steady_time;
+			if (teresa->getHeight(height_tmp,stamp)) {
+				//ROS_INFO("%d",height_tmp);
+				head_changed = height_tmp != height_in_millimeters;
+				height_in_millimeters = height_tmp;
+				height_in_meters= (double)height_in_millimeters * 0.001;
+				height_time = toRosTime(stamp);
+				height_model.correct(height_tmp,stamp);
+			}
 		
-        	if (teresa->getTilt(tilt_in_degrees)) {
-			//ROS_INFO("%d",tilt_in_degrees);
-			tilt_in_radians = tilt_in_degrees * 0.0174533;
-		}
-
-		geometry_msgs::TransformStamped stalk_trans;
-		stalk_trans.header.stamp = current_time;
-		stalk_trans.header.frame_id = base_frame_id;
-		stalk_trans.child_frame_id = stalk_frame_id;
-		stalk_trans.transform.translation.x = 0.0;
-		stalk_trans.transform.translation.y = 0.0;
-		stalk_trans.transform.translation.z = height_in_meters;
-		stalk_trans.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, 0.0);
-		tf_broadcaster.sendTransform(stalk_trans);
-
-		geometry_msgs::TransformStamped head_trans;
-		head_trans.header.stamp = current_time;
-		head_trans.header.frame_id = stalk_frame_id;
-		head_trans.child_frame_id = head_frame_id;
-		head_trans.transform.translation.x = 0.0;
-		head_trans.transform.translation.y = 0.0;
-		head_trans.transform.translation.z = 0.0;
-		head_trans.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, tilt_in_radians, 0.0);
-		tf_broadcaster.sendTransform(head_trans);
-
-		// ******************************************************************************************
-		//next, we'll publish the odometry message over ROS
-		nav_msgs::Odometry odom;
-		odom.header.stamp = current_time;
-		odom.header.frame_id = odom_frame_id;
-		
-		//set the position
-		odom.pose.pose.position.x = pos_x;
-		odom.pose.pose.position.y = pos_y;
-		odom.pose.pose.position.z = 0.0;
-		odom.pose.pose.orientation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, yaw);
-		
-		//set the velocity
-		odom.child_frame_id = base_frame_id;
-		odom.twist.twist.linear.x = lin_vel;
-		odom.twist.twist.linear.y = 0.0; 
-		odom.twist.twist.angular.z = ang_vel;
-		
-		//publish the odometry
-		odom_pub.publish(odom);
-
-		//publish the state of the batteries
-		if (teresa->getBatteryStatus(elec_level,PC1_level,motorH_level,motorL_level,charger_status)) {
-			teresa_driver::Batteries battmsg;
-			battmsg.header.stamp = current_time;
-			battmsg.elec_level = elec_level;
-			battmsg.PC1_level = PC1_level;
-			battmsg.motorH_level = motorH_level;
-			battmsg.motorL_level = motorL_level;
-			battmsg.charger_status = charger_status;
-			batteries_pub.publish(battmsg);	
-		}
-
-		//publish the state of the buttons
-		if (publish_buttons &&	teresa->getButtons(button1_tmp,button2_tmp) && 
-			(first_time || button1!=button1_tmp || button2!=button2_tmp)) {
-			button1 = button1_tmp;
-			button2 = button2_tmp;
-			teresa_driver::Buttons buttonsmsg;
-			buttonsmsg.header.stamp = current_time;
-			buttonsmsg.button1=button1;
-			buttonsmsg.button2=button2;
-			buttons_pub.publish(buttonsmsg);
-		}
-		//publish the state of the rotaryEncoder				
-		if (publish_volume && teresa->getRotaryEncoder(rotaryEncoder) && rotaryEncoder!=0) {
-			teresa_driver::Volume volumemsg;
-			volumemsg.header.stamp = current_time;
-			volumemsg.volume_inc=rotaryEncoder;
-			volume_pub.publish(volumemsg);
-		}
-		//publish the temperatures
-		if (publish_temperature &&
-			teresa->getTemperature(temperature_left_motor,
-						temperature_right_motor,
-						temperature_left_driver,
-						temperature_right_driver,
-						tilt_overheat,
-						height_overheat)) {
-			teresa_driver::Temperature temperaturemsg;
-			temperaturemsg.header.stamp = current_time;
-			temperaturemsg.left_motor_temperature = temperature_left_motor;
-			temperaturemsg.right_motor_temperature = temperature_right_motor;
-			temperaturemsg.left_driver_temperature = temperature_left_driver;
-			temperaturemsg.right_driver_temperature = temperature_right_driver;
-			temperaturemsg.tilt_driver_overheat = tilt_overheat;
-			temperaturemsg.height_driver_overheat = height_overheat;
-			temperature_pub.publish(temperaturemsg);
-		}
-
-		//publish diagnostics
-		if (publish_diagnostics && teresa->getPowerDiagnostics(diagnostics)) {
-			teresa_driver::Diagnostics diagnosticsmsg;
-			diagnosticsmsg.header.stamp = current_time;
-			diagnosticsmsg.elec_bat_voltage = diagnostics.elec_bat_voltage;
-			diagnosticsmsg.PC1_bat_voltage = diagnostics.PC1_bat_voltage;
-			diagnosticsmsg.cable_bat_voltage = diagnostics.cable_bat_voltage;
-			diagnosticsmsg.motor_voltage = diagnostics.motor_voltage;
-			diagnosticsmsg.motor_h_voltage = diagnostics.motor_h_voltage;
-			diagnosticsmsg.motor_l_voltage = diagnostics.motor_l_voltage;
-			diagnosticsmsg.elec_instant_current = diagnostics.elec_instant_current;
-			diagnosticsmsg.motor_instant_current = diagnostics.motor_instant_current;
-			diagnosticsmsg.elec_integrated_current = diagnostics.elec_integrated_current;
-			diagnosticsmsg.motor_integrated_current = diagnostics.motor_integrated_current;
-			diagnosticsmsg.average_loop_freq = 1.0 / (loopDurationSum/(double)loopCounter);
-			diagnostics_pub.publish(diagnosticsmsg);
-		}
-
-		// Leds Pattern
-		if (leds!=NULL) {
-			teresa->setLeds(leds->getLeds());
-			leds->update();
-		}
-		first_time=false;
-		r.sleep();	
-		ros::spinOnce();
-		loopDurationSum += (ros::Time::now() - current_time).toSec();
+			if (teresa->getTilt(tilt_tmp,stamp)) {
+				//ROS_INFO("%d",tilt_tmp);
+				head_changed = head_changed || tilt_tmp != tilt_in_degrees;
+				tilt_in_degrees = tilt_tmp;
+				tilt_in_radians = tilt_in_degrees * 0.0174533;
+				tilt_time = toRosTime(stamp);
+				tilt_model.correct(tilt_tmp,stamp);
+			}
+			if (head_changed) {
+				head_active_until = current_steady_time + head_settle_time;
+			}
+		} else if (head_moving) {
+			// Predicted pose between readings
+			height_in_meters = height_model.predict(current_steady_time) * 0.001;
+			tilt_in_radians = tilt_model.predict(current_steady_time) * 0.0174533;
+			head_changed = true;
+		}
+		updateHead(current_steady_time);
+		profiler.toc(SECTION_HEAD_READ,section_start);
+		section_start = profiler.tic();
+
+		// Unchanged head transforms are sent again at the keep-alive rate with the current time
+		if (!head_change_detection || head_changed || current_steady_time - head_tf_time >= 1.0/head_keepalive_freq) {
+			transforms[TF_STALK].header.stamp = head_changed || !head_change_detection ? height_time : current_time;
+			transforms[TF_STALK].transform.translation.z = height_in_meters;
+			transforms[TF_HEAD].header.stamp = head_changed || !head_change_detection ? tilt_time : current_time;
+			transforms[TF_HEAD].transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, tilt_in_radians, 0.0);
+			if (odometry_freq <= 0 && !odom_tf_ready) { // No encoder sample yet
+				tf_broadcaster.sendTransform(transforms[TF_STALK]);
+				tf_broadcaster.sendTransform(transforms[TF_HEAD]);
+			} else {
+				tf_broadcaster.sendTransform(transforms);
+			}
+			head_tf_time = current_steady_time;
+		} else if (odometry_freq <= 0 && odom_tf_ready) {
+			tf_broadcaster.sendTransform(transforms[TF_ODOM]);
+		}
+		profiler.toc(SECTION_TF,section_start);
+
+		// Optional stages, while the budget of the cycle allows it
+		stages.begin(current_steady_time, load_shedding ? cycle_budget_ratio * r.getPeriod() : 
+								std::numeric_limits<double>::infinity());
+		int stage;
+		while ((stage = stages.next()) != -1) {
+			double stage_start = utils::monotonicNow();
+			runStage(stage);
+			double stage_duration = utils::monotonicNow() - stage_start;
+			stages.done(stage,stage_duration);
+			profiler.add(SECTION_STAGES+stage,stage_duration);
+		}
+		stages.end();
+		profiler.toc(SECTION_CYCLE,current_steady_time);
+		if (publish_loop_timing && current_steady_time - last_loop_timing >= loop_timing_period) {
+			publishLoopTiming(current_time,r);
+			last_loop_timing = current_steady_time;
+		}
+		if (updateLoopPeriod(r)) {
+			ROS_INFO(idle ? "Entering idle mode" : "Leaving idle mode");
+		}
+		if (idle) {
+			// Wait for the deadline processing callbacks, so a command ends the idle mode at once
+			double remaining;
+			while (idle && n.ok() && (remaining = r.remaining()) > 0) {
+				section_start = profiler.tic();
+				ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(remaining));
+				profiler.toc(SECTION_SPIN,section_start);
+			}
+			if (!updateLoopPeriod(r)) {
+				r.start();
+			} else {
+				ROS_INFO("Leaving idle mode");
+			}
+		} else {
+			if (!r.sleep()) {
+				ROS_WARN_THROTTLE(5.0,"Main loop overrun (%lu overruns, %lu missed deadlines)",r.overruns(),r.missed());
+			}
+			section_start = profiler.tic();
+			ros::spinOnce();
+			profiler.toc(SECTION_SPIN,section_start);
+		}
+		loopDurationSum += utils::monotonicNow() - current_steady_time;
 		loopCounter++;
 		
 	}	
@@ -44,9 +44,11 @@
 #include <teresa_driver/Diagnostics.h>
 #include <teresa_driver/CmdVelRaw.h>
 #include <teresa_driver/WheelVels.h>
+#include <teresa_driver/Calibration_sweep.h>
 #include <teresa_driver/simulated_teresa_robot.hpp>
 #include <teresa_driver/idmind_teresa_robot.hpp>
 #include <teresa_driver/teresa_leds.hpp>
+#include <teresa_driver/calibration_sweep.hpp>
 
 //Boost
 #include <boost/thread.hpp>  // Mutex
@@ -84,6 +86,10 @@ private:
 			teresa_driver::Get_DCDC::Response &res); // Get DCDC service
 	bool teresaLeds(teresa_driver::Teresa_leds::Request &req,
 				teresa_driver::Teresa_leds::Response &res); // The Leds service
+	bool calibrationSweep(teresa_driver::Calibration_sweep::Request &req,
+				teresa_driver::Calibration_sweep::Response &res); // The calibration sweep service
+	void updateSweep(double left_wheel_vel, double right_wheel_vel, const ros::Time& current_time); // Run a cycle of the sweep
+	void finishSweep(); // Write the calibration file of a finished sweep
 
 	static void printInfo(const std::string& message){ROS_INFO("%s",message.c_str());} // Print Info function
 	static void printError(const std::string& message){ROS_ERROR("%s",message.c_str());} // Print Error function
@@ -126,11 +132,19 @@ private:
 	ros::Publisher wheels_motor_pub;
 	teresa_driver::CmdVelRaw motor_units;
 	boost::mutex motor_mutex;
+
+	// Calibration sweep
+	utils::CalibrationSweep sweep;
+	utils::SweepConfig sweep_config;
+	std::string sweep_default_file; // The calibration_sweep_file parameter
+	std::string sweep_file; // File of the running sweep
+	std::string sweep_result; // Outcome of the last sweep
 	
 	// Services
 	ros::ServiceServer set_dcdc_service;
 	ros::ServiceServer get_dcdc_service;
 	ros::ServiceServer leds_service;
+	ros::ServiceServer sweep_service;
 
 	// Some time stamps... see the code below
 	ros::Time imu_time; 
@@ -171,6 +185,7 @@ NodeCalib::NodeCalib(ros::NodeHandle& n, ros::NodeHandle& pn)
 		std::string board1;
 		std::string board2;
 		std::string leds_pattern;
+		std::string calibration_file;
 		int initial_dcdc_mask,final_dcdc_mask,number_of_leds;
 	        // Parameters
 		pn.param<std::string>("board1",board1,"/dev/ttyUSB0");
@@ -198,16 +213,35 @@ NodeCalib::NodeCalib(ros::NodeHandle& n, ros::NodeHandle& pn)
 		pn.param<double>("B_left",calibration.B_left,8.35);
 		pn.param<double>("A_right",calibration.A_right,210.0);
 		pn.param<double>("B_right",calibration.B_right,8.35);
+		pn.param<std::string>("calibration_file",calibration_file,"");
+		std::string calibration_error;
+		if (!initCalibrationTables(calibration,calibration_file,calibration_error)) {
+			ROS_ERROR("Invalid calibration: %s",calibration_error.c_str());
+			if (calibration.left_table.isEmpty() || calibration.right_table.isEmpty()) {
+				throw ("Teresa initialization aborted: no calibration tables");
+			}
+		}
+		double sweep_settle_time;
+		pn.param<std::string>("calibration_sweep_file",sweep_default_file,"teresa_calibration.txt");
+		pn.param<int>("calibration_sweep_min_units",sweep_config.min_units,15);
+		pn.param<int>("calibration_sweep_max_units",sweep_config.max_units,130);
+		pn.param<int>("calibration_sweep_steps",sweep_config.steps,8);
+		pn.param<double>("calibration_sweep_settle_time",sweep_settle_time,0.5);
+		pn.param<double>("calibration_sweep_settle_tolerance",sweep_config.settle_tolerance,0.01);
+		pn.param<double>("calibration_sweep_settle_timeout",sweep_config.settle_timeout,5.0);
+		pn.param<double>("calibration_sweep_sample_time",sweep_config.sample_time,2.0);
+		pn.param<double>("calibration_sweep_min_velocity",sweep_config.min_velocity,0.03);
 		//pn.param<double>("lin_vel_dead_zone",lin_vel_dead_zone,0.15);
 		//pn.param<double>("ang_vel_dead_zone",ang_vel_dead_zone,0.3);
 		//pn.param<double>("lin_vel_zero_threshold",lin_vel_zero_threshold,0.05);
 		//pn.param<double>("ang_vel_zero_threshold",ang_vel_zero_threshold,0.05);
+		sweep_config.settle_samples = std::max(2,(int)std::round(sweep_settle_time*freq));
 		leds = getLedsPattern(leds_pattern,number_of_leds);
 		
 		if (simulation) {
 			using_imu=0;
 			// Using a simulated robot, for debugging and testing
-			teresa = new SimulatedRobot(); 
+			teresa = new SimulatedRobot(calibration); 
 		} else {
 			// Using the IdMind robot
 			teresa = new IdMindRobot(board1,board2,calibration,initial_dcdc_mask,final_dcdc_mask,number_of_leds,printInfo,printError);
@@ -245,6 +279,7 @@ NodeCalib::NodeCalib(ros::NodeHandle& n, ros::NodeHandle& pn)
 		set_dcdc_service = n.advertiseService("set_teresa_dcdc", &NodeCalib::setDCDC,this);
 		get_dcdc_service = n.advertiseService("get_teresa_dcdc", &NodeCalib::getDCDC,this);				
 		leds_service = n.advertiseService("teresa_leds", &NodeCalib::teresaLeds,this);
+		sweep_service = n.advertiseService("teresa_calibration_sweep", &NodeCalib::calibrationSweep,this);
 		// Run the main loop
 		loop();
 	} catch (const char* msg) {
@@ -301,7 +336,8 @@ void NodeCalib::stalkReceived(const teresa_driver::Stalk::ConstPtr& stalk)
 	}
 	else if (heightMotor!=MOTOR_STOP){ // height motor STOP
 		int height_in_millimeters=0;
-		if (teresa->getHeight(height_in_millimeters) &&
+		double stamp;
+		if (teresa->getHeight(height_in_millimeters,stamp) &&
 			teresa->setHeight(height_in_millimeters)) {
 			heightMotor = MOTOR_STOP;
 		}
@@ -318,7 +354,8 @@ void NodeCalib::stalkReceived(const teresa_driver::Stalk::ConstPtr& stalk)
 	}
 	else if (tiltMotor!=MOTOR_STOP){ // tilt motor STOP
 		int tilt_in_degrees=0;
-		if (teresa->getTilt(tilt_in_degrees) &&
+		double stamp;
+		if (teresa->getTilt(tilt_in_degrees,stamp) &&
 			teresa->setTilt(tilt_in_degrees)) {
 			tiltMotor = MOTOR_STOP;
 		}
@@ -338,6 +375,9 @@ inline
 void NodeCalib::cmdVelReceived(const geometry_msgs::Twist::ConstPtr& cmd_vel)
 { 
 	cmd_vel_time = ros::Time::now(); // Get the time
+	if (sweep.isRunning()) { // The sweep drives the wheels
+		return;
+	}
 	if (!imu_error) { // If IMU error, do not move!
 		double cmdLinVel = cmd_vel->linear.x;
 		double cmdAngVel = cmd_vel->angular.z;
@@ -368,15 +408,10 @@ teresa_driver::CmdVelRaw NodeCalib::cmdVel2MotorUnits(geometry_msgs::Twist cmd)
 	double av = cmd.angular.z;
 	double left_wheel_vel = lv - ROBOT_RADIUS_M * av;
 	double right_wheel_vel = lv + ROBOT_RADIUS_M * av;
-	int16_t v_left=0;
-	int16_t v_right=0;
-	v_left = (int16_t)std::round(fabs(left_wheel_vel) * calibration.A_left + calibration.B_left);
-	//if (calibration.inverse_left_motor) v_left = -v_left;
-	if (left_wheel_vel<0) v_left *= -1; 
-	
-	v_right = (int16_t)std::round(fabs(right_wheel_vel) * calibration.A_right + calibration.B_right);
-	//if (calibration.inverse_right_motor) v_right = -v_right;
-	if (right_wheel_vel<0) v_right *= -1;
+	// Same tables as setVelocity(), without the motor inversion nor the dead band. The linear tables
+	// give sign(v)*(|v|*A + B) as before, +B for a zero velocity, but a file table gives its own value
+	int16_t v_left = (int16_t)std::round(calibration.left_table.getUnits(left_wheel_vel));
+	int16_t v_right = (int16_t)std::round(calibration.right_table.getUnits(right_wheel_vel));
 
 	teresa_driver::CmdVelRaw units;
 	units.left_wheel = v_left;
@@ -435,6 +470,95 @@ bool NodeCalib::teresaLeds(teresa_driver::Teresa_leds::Request &req,
 	return true;
 }
 
+// Calibration sweep service
+inline
+bool NodeCalib::calibrationSweep(teresa_driver::Calibration_sweep::Request &req,
+			teresa_driver::Calibration_sweep::Response &res)
+{
+	res.success = true;
+	if (req.command == teresa_driver::Calibration_sweep::Request::START) {
+		std::string error;
+		if (imu_error) {
+			res.success = false;
+			sweep_result = "not started, IMU error";
+		} else if (sweep.start(sweep_config,error)) {
+			sweep_file = req.file.empty() ? sweep_default_file : req.file;
+			sweep_result = "";
+			ROS_INFO("Calibration sweep started, the robot will rotate in place");
+		} else {
+			res.success = false;
+			sweep_result = "not started, "+error;
+		}
+	} else if (req.command == teresa_driver::Calibration_sweep::Request::ABORT) {
+		if (sweep.isRunning()) {
+			sweep.abort();
+			teresa->setVelocityRaw(0,0);
+			sweep_result = "aborted by the service";
+			ROS_WARN("Calibration sweep %s",sweep_result.c_str());
+		}
+	} else if (req.command != teresa_driver::Calibration_sweep::Request::STATUS) {
+		res.success = false;
+	}
+	res.running = sweep.isRunning();
+	std::vector<std::string> lines;
+	sweep.getReport(lines);
+	if (!sweep_result.empty()) {
+		lines.push_back(sweep_result);
+	}
+	for (unsigned i=0;i<lines.size();i++) {
+		res.report += lines[i]+"\n";
+	}
+	return true;
+}
+
+// Drive the wheels with the sweep and write the result when it finishes
+inline
+void NodeCalib::updateSweep(double left_wheel_vel, double right_wheel_vel, const ros::Time& current_time)
+{
+	int16_t left_units,right_units;
+	bool running = sweep.update(current_time.toSec(),left_wheel_vel,right_wheel_vel,left_units,right_units);
+	// The sweep units are the ones of the tables, before the inversion of the motors
+	teresa->setVelocityRaw(calibration.inverse_left_motor ? -left_units : left_units,
+				calibration.inverse_right_motor ? -right_units : right_units);
+	motor_mutex.lock();
+	motor_units.left_wheel = left_units;
+	motor_units.right_wheel = right_units;
+	motor_mutex.unlock();
+	if (!running) {
+		finishSweep();
+	}
+}
+
+inline
+void NodeCalib::finishSweep()
+{
+	std::vector<std::string> lines;
+	sweep.getReport(lines);
+	for (unsigned i=0;i<lines.size();i++) {
+		ROS_INFO("%s",lines[i].c_str());
+	}
+	utils::CalibrationTable tables[2];
+	bool measured[2];
+	if (!sweep.getTable(0,LINEAR_VELOCITY_ZERO_THRESHOLD,MAX_LINEAR_VELOCITY,tables[0],measured[0]) ||
+		!sweep.getTable(1,LINEAR_VELOCITY_ZERO_THRESHOLD,MAX_LINEAR_VELOCITY,tables[1],measured[1])) {
+		sweep_result = "no calibration written, a wheel has less than two valid points";
+	} else {
+		for (int i=0;i<2;i++) {
+			if (!measured[i]) {
+				lines.push_back(std::string("the measured points of the ")+(i==0 ? "left" : "right")+
+						" wheel are not monotonic, its table is the linear fit");
+				ROS_WARN("%s",lines.back().c_str());
+			}
+		}
+		if (utils::saveWheelCalibration(sweep_file,tables[0],tables[1],lines)) {
+			sweep_result = "calibration written to "+sweep_file;
+		} else {
+			sweep_result = "cannot write "+sweep_file;
+		}
+	}
+	ROS_INFO("Calibration sweep %s",sweep_result.c_str());
+}
+
 // Main Loop
 inline
 void NodeCalib::loop()
@@ -451,6 +575,7 @@ void NodeCalib::loop()
 	ros::Rate r(freq);
 	tf::TransformBroadcaster tf_broadcaster;
 	double imdl,imdr;
+	double stamp; // Response times are not used by the calibration
 	double dt;
 	bool first_time=true;
 	double height_in_meters=0;
@@ -471,6 +596,11 @@ void NodeCalib::loop()
 		if (using_imu) {		
 			double imu_sec = (current_time - imu_time).toSec();
 			if(imu_sec >= 0.25){
+				if (sweep.isRunning()) {
+					sweep.abort();
+					sweep_result = "aborted by an IMU timeout";
+					ROS_ERROR("Calibration sweep %s",sweep_result.c_str());
+				}
 				teresa->setVelocity(0,0);
 				ang_vel = 0;
 				imu_error = true;
@@ -480,10 +610,10 @@ void NodeCalib::loop()
 			}
 		}
 		double cmd_vel_sec = (current_time - cmd_vel_time).toSec();
-		if (cmd_vel_sec >= 0.5) {
+		if (cmd_vel_sec >= 0.5 && !sweep.isRunning()) {
 			teresa->setVelocity(0,0);
 		}
-		teresa->getIMD(imdl,imdr);
+		teresa->getIMD(imdl,imdr,stamp);
 		dt = (current_time - last_time).toSec();
 		if (!using_imu) {
 			double vr = imdr/dt;
@@ -500,6 +630,10 @@ void NodeCalib::loop()
 		}
 
 
+		if (sweep.isRunning()) {
+			updateSweep(imdl/dt,imdr/dt,current_time);
+		}
+
 		//Publish topics for calibration
 		motor_mutex.lock();
 		teresa_driver::CmdVelRaw munits = motor_units;
@@ -524,11 +658,11 @@ void NodeCalib::loop()
 		odom_trans.transform.translation.z = 0.0;
 		odom_trans.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, yaw);
 		tf_broadcaster.sendTransform(odom_trans);
-		if (teresa->getHeight(height_in_millimeters)) {
+		if (teresa->getHeight(height_in_millimeters,stamp)) {
 			height_in_meters= (double)height_in_millimeters * 0.001;
 		}
 		
-        	if (teresa->getTilt(tilt_in_degrees)) {
+        	if (teresa->getTilt(tilt_in_degrees,stamp)) {
 			tilt_in_radians = tilt_in_degrees * 0.0174533;
 		}
 
@@ -574,7 +708,7 @@ void NodeCalib::loop()
 		odom_pub.publish(odom);
 
 		//publish the state of the batteries
-		if (teresa->getBatteryStatus(elec_level,PC1_level,motorH_level,motorL_level,charger_status)) {
+		if (teresa->getBatteryStatus(elec_level,PC1_level,motorH_level,motorL_level,charger_status,stamp)) {
 			teresa_driver::Batteries battmsg;
 			battmsg.header.stamp = current_time;
 			battmsg.elec_level = elec_level;
@@ -586,7 +720,7 @@ void NodeCalib::loop()
 		}
 
 		//publish the state of the buttons
-		if (publish_buttons &&	teresa->getButtons(button1_tmp,button2_tmp) && 
+		if (publish_buttons &&	teresa->getButtons(button1_tmp,button2_tmp,stamp) && 
 			(first_time || button1!=button1_tmp || button2!=button2_tmp)) {
 			button1 = button1_tmp;
 			button2 = button2_tmp;
@@ -597,7 +731,7 @@ void NodeCalib::loop()
 			buttons_pub.publish(buttonsmsg);
 		}
 		//publish the state of the rotaryEncoder				
-		if (publish_volume && teresa->getRotaryEncoder(rotaryEncoder) && rotaryEncoder!=0) {
+		if (publish_volume && teresa->getRotaryEncoder(rotaryEncoder,stamp) && rotaryEncoder!=0) {
 			teresa_driver::Volume volumemsg;
 			volumemsg.header.stamp = current_time;
 			volumemsg.volume_inc=rotaryEncoder;
@@ -610,7 +744,8 @@ void NodeCalib::loop()
 						temperature_left_driver,
 						temperature_right_driver,
 						tilt_overheat,
-						height_overheat)) {
+						height_overheat,
+						stamp)) {
 			teresa_driver::Temperature temperaturemsg;
 			temperaturemsg.header.stamp = current_time;
 			temperaturemsg.left_motor_temperature = temperature_left_motor;
@@ -623,7 +758,7 @@ void NodeCalib::loop()
 		}
 
 		//publish diagnostics
-		if (publish_diagnostics && teresa->getPowerDiagnostics(diagnostics)) {
+		if (publish_diagnostics && teresa->getPowerDiagnostics(diagnostics,stamp)) {
 			teresa_driver::Diagnostics diagnosticsmsg;
 			diagnosticsmsg.header.stamp = current_time;
 			diagnosticsmsg.elec_bat_voltage = diagnostics.elec_bat_voltage;
@@ -27,6 +27,9 @@
 #define _TERESA_ROBOT_HPP_
 
 #include <cmath>
+#include <string>
+#include <stdint.h>
+#include "calibration_table.hpp"
 
 namespace Teresa
 {
@@ -40,6 +43,8 @@ namespace Teresa
 #define ROBOT_DIAMETER_M                      0.47
 #define ROBOT_RADIUS_M                       0.235
 
+#define METERS_PER_TICK                 0.00024802
+
 #define MAX_LINEAR_VELOCITY                    0.6
 #define MAX_ANGULAR_VELOCITY             1.5707963
 
@@ -49,6 +54,108 @@ namespace Teresa
 
 
 
+/**
+ * Calibration of the wheel motors
+ *
+ * The tables map the wheel velocity in m/s to motor units (see initCalibrationTables())
+ */
+struct Calibration
+{
+	double A_left;
+	double B_left;
+	double A_right;
+	double B_right;
+	bool inverse_left_motor;
+	bool inverse_right_motor;
+	utils::CalibrationTable left_table; // Used by setVelocity()
+	utils::CalibrationTable right_table;
+	utils::CalibrationTable left_upo_table; // Used by setVelocity2()
+	utils::CalibrationTable right_upo_table;
+};
+
+/**
+ * Set the calibration tables from a file, or from the linear coefficients if there is no file
+ *
+ * The linear tables of setVelocity() are sign(v)*(|v|*A + B), odd tables that leave out
+ * the dead band of LINEAR_VELOCITY_ZERO_THRESHOLD, and the ones of setVelocity2() are
+ * v*A + B. The tables of a file are used by both.
+ * @param calibration[IN/OUT] the calibration, with the linear coefficients set
+ * @param file the calibration file (see utils::loadWheelCalibration()), empty to use the linear coefficients
+ * @param error[OUT] the error message if fail
+ * @return true if success, false otherwise (the linear tables are set if possible)
+ */
+inline
+bool initCalibrationTables(Calibration& calibration, const std::string& file, std::string& error)
+{
+	if (!file.empty() && utils::loadWheelCalibration(file,calibration.left_table,calibration.right_table,error)) {
+		calibration.left_upo_table = calibration.left_table;
+		calibration.right_upo_table = calibration.right_table;
+		return true;
+	}
+	bool success = file.empty();
+	const double max = MAX_LINEAR_VELOCITY;
+	const double zero = LINEAR_VELOCITY_ZERO_THRESHOLD;
+	double A[2] = {calibration.A_left,calibration.A_right};
+	double B[2] = {calibration.B_left,calibration.B_right};
+	utils::CalibrationTable* tables[2] = {&calibration.left_table,&calibration.right_table};
+	utils::CalibrationTable* upo_tables[2] = {&calibration.left_upo_table,&calibration.right_upo_table};
+	for (int i=0;i<2;i++) {
+		if (!(A[i] > 0)) {
+			error = "the linear calibration coefficient A is not positive";
+			success = false;
+			continue;
+		}
+		std::vector<double> velocities(2),units(2);
+		velocities[0] = zero; units[0] = zero*A[i] + B[i];
+		velocities[1] = max; units[1] = max*A[i] + B[i];
+		std::vector<double> upo_velocities(2),upo_units(2);
+		upo_velocities[0] = -max; upo_units[0] = -max*A[i] + B[i];
+		upo_velocities[1] = max; upo_units[1] = max*A[i] + B[i];
+		tables[i]->setPoints(velocities,units,true);
+		upo_tables[i]->setPoints(upo_velocities,upo_units);
+	}
+	return success;
+}
+
+/**
+ * Fit the linear coefficients to a calibration table, e.g. as the prior of an online estimation
+ *
+ * @param table the table
+ * @param absolute true to fit |units| = A*|v| + B (setVelocity()), false to fit units = A*v + B (setVelocity2())
+ * @param A[OUT] the slope
+ * @param B[OUT] the offset
+ * @return true if success, false otherwise
+ */
+inline
+bool fitCalibrationTable(const utils::CalibrationTable& table, bool absolute, double& A, double& B)
+{
+	const std::vector<double>& velocities = table.getVelocities();
+	const std::vector<double>& units = table.getUnits();
+	std::vector<double> x,y;
+	for (unsigned i=0;i<velocities.size();i++) {
+		if (absolute) {
+			if (std::abs(velocities[i]) >= LINEAR_VELOCITY_ZERO_THRESHOLD) { // sign(v)*units, B may be negative
+				x.push_back(std::abs(velocities[i]));
+				y.push_back(velocities[i] < 0 ? -units[i] : units[i]);
+			}
+		} else {
+			x.push_back(velocities[i]);
+			y.push_back(units[i]);
+			if (table.isOdd()) {
+				x.push_back(-velocities[i]);
+				y.push_back(-units[i]);
+			}
+		}
+	}
+	utils::LineFit fit;
+	if (!utils::fitLine(x,y,fit)) {
+		return false;
+	}
+	A = fit.slope;
+	B = fit.offset;
+	return true;
+}
+
 struct PowerDiagnostics
 {
 	double elec_bat_voltage;     // V
@@ -100,20 +207,72 @@ public:
 	 * @return true if success, false otherwise
 	 */
 	virtual bool setVelocityRaw(int16_t leftWheelRef, int16_t rightWheelRef) = 0;
+	/**
+	 * Get the last motor units sent to the wheels (zero while the emergency stop is latched)
+	 *
+	 * @param[out] left the left wheel motor units
+	 * @param[out] right the right wheel motor units
+	 */
+	virtual void getMotorUnits(int16_t& left, int16_t& right) = 0;
+	/**
+	 * Replace the calibration used by setVelocity() and setVelocity2()
+	 *
+	 * @param[in] calibration the new calibration, with its tables set
+	 * @return true if success, false otherwise
+	 */
+	virtual bool setCalibration(const Calibration& calibration) = 0;
 	/**
 	 * Check if the robot is stopped
 	 *
 	 * @return true if robot is stopped, false otherwise
 	 */ 
 	virtual bool isStopped() = 0;
+	/**
+	 * Stop the wheels right away, before any other queued transaction of the motors board
+	 *
+	 * Unlike emergencyStop(), it does not latch, so the next velocity command moves the robot again.
+	 *
+	 * @return true if success, false otherwise
+	 */
+	virtual bool stop() = 0;
+	/**
+	 * Latch or clear the emergency stop
+	 *
+	 * Latching it stops the wheels right away, before any other queued transaction of
+	 * the motors board. While it is latched, every velocity command is sent as zero.
+	 *
+	 * @param[in] stop true to latch the emergency stop, false to clear it
+	 * @return true if success, false otherwise
+	 */
+	virtual bool emergencyStop(bool stop) = 0;
+	/**
+	 * Check if the emergency stop is latched
+	 *
+	 * @return true if latched, false otherwise
+	 */
+	virtual bool isEmergencyStopped() = 0;
 	/**
 	 * Get the distance traveled by each wheel since the last call to this function
 	 *
 	 * @param[out] imdl the distance traveled by the left wheel in meters
 	 * @param[out] imdr the distance traveled by the right wheel in meters
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
 	 * @return true if success, false otherwise
 	 */ 
-	virtual bool getIMD(double& imdl, double& imdr) = 0;
+	virtual bool getIMD(double& imdl, double& imdr, double& stamp) = 0;
+	/**
+	 * Read the encoders and get the cumulative ticks of each wheel since the robot was opened
+	 *
+	 * getIMD() and getTicks() read the same encoder increments, the cumulative
+	 * counters include the ticks read by both of them. Multiply by METERS_PER_TICK
+	 * to get meters.
+	 *
+	 * @param[out] left the cumulative ticks of the left wheel
+	 * @param[out] right the cumulative ticks of the right wheel
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
+	 * @return true if success, false otherwise
+	 */
+	virtual bool getTicks(int64_t& left, int64_t& right, double& stamp) = 0;
 	/**
 	 * Set the height velocity 
 	 *
@@ -146,31 +305,35 @@ public:
 	 * Get the height
 	 *
 	 * height[out] the height in millimeters 
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
 	 * @return true if success, false otherwise
 	 */
-	virtual bool getHeight(int& height) = 0;
+	virtual bool getHeight(int& height, double& stamp) = 0;
 	/**
 	 * Get the tilt angle
 	 *
 	 * @param[out] tilt angle in degrees
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
 	 * @return true if success, false otherwise
 	 */
-	virtual bool getTilt(int& tilt) = 0;
+	virtual bool getTilt(int& tilt, double& stamp) = 0;
 	/**
 	 * Check if some button has been pressed
 	 *
 	 * @param[out] button1 true if button1 has been pressed since the last read, false otherwise
 	 * @param[out] button2 true if button2 has been pressed since the last read, false otherwise
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
          * @return true if success, false otherwise
 	 */
-	virtual bool getButtons(bool& button1, bool& button2) = 0;
+	virtual bool getButtons(bool& button1, bool& button2, double& stamp) = 0;
 	/**
 	 * Get the encoder steps positive or negative counted since the last reading
 	 *
 	 * @param[out] rotaryEncoder the encoder steps since the last reading
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
 	 * @return true if success, false otherwise	
 	 */
-	virtual bool getRotaryEncoder(int& rotaryEncoder) = 0;	
+	virtual bool getRotaryEncoder(int& rotaryEncoder, double& stamp) = 0;	
 
 	/**
 	 * Get temperature information
@@ -181,6 +344,7 @@ public:
 	 * @param[out] rightDriver temperature of the right driver in celsius degrees
 	 * @param[out] tiltDriverOverheat true if tilt driver is overheat, false otherwise
 	 * @param[out] heightDriverOverheat true if height driver is overheat, false otherwise
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
 	 * @return true if success, false otherwise
 	 */
 	virtual bool getTemperature(int& leftMotor, 
@@ -188,7 +352,8 @@ public:
 					int& leftDriver, 
 					int& rightDriver, 
 					bool& tiltDriverOverheat, 
-					bool& heightDriverOverheat) = 0;
+					bool& heightDriverOverheat,
+					double& stamp) = 0;
 
 	/**
 	 * enable/disable DCDC outputs
@@ -244,22 +409,25 @@ public:
 	 *		C = 0 Charger 3 charge ongoing
 	 *		D = 1 Charger 4 charge ended
 	 *		D = 0 Charger 4 charge ongoing
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
 	 * @return true if success, false otherwise
 	 */
 	virtual bool getBatteryStatus(unsigned char& elec_level, 
 					unsigned char& PC1_level, 
 					unsigned char& motorH_level, 
 					unsigned char& motorL_level, 
-					unsigned char& charger_status) = 0;
+					unsigned char& charger_status,
+					double& stamp) = 0;
 
 
 	/**
 	 * get Power diagnostics
 	 *
 	 * @param[out] diagnostics struct of PowerDiagnostics with information
+	 * @param[out] stamp CLOCK_MONOTONIC time in seconds when the response was received (see utils::monotonicNow())
 	 * @return true if success, false otherwise
 	 */
-	virtual bool getPowerDiagnostics(PowerDiagnostics& diagnostics) = 0;
+	virtual bool getPowerDiagnostics(PowerDiagnostics& diagnostics, double& stamp) = 0;
 protected:
 	/**
 	 * Saturate a linear velocity value
@@ -277,6 +445,15 @@ protected:
 	 * @return the saturated angular velocity in rad/s
 	 */
 	static double saturateAngularVelocity(double v);	
+	/**
+	 * Motor units of a wheel velocity
+	 *
+	 * @param[in] v the wheel velocity in m/s
+	 * @param[in] table the calibration table of the wheel
+	 * @param[in] inverse is the motor inverted?
+	 * @return the motor units, 0 if std::abs(v)<=LINEAR_VELOCITY_ZERO_THRESHOLD
+	 */
+	static int16_t toMotorUnits(double v, const utils::CalibrationTable& table, bool inverse);
 
 private:
 	/**
@@ -305,6 +482,16 @@ double Robot::saturateAngularVelocity(double v)
 	return saturate(v,MAX_ANGULAR_VELOCITY,ANGULAR_VELOCITY_ZERO_THRESHOLD);
 }	
 
+inline
+int16_t Robot::toMotorUnits(double v, const utils::CalibrationTable& table, bool inverse)
+{
+	if (v<=LINEAR_VELOCITY_ZERO_THRESHOLD && v>=-LINEAR_VELOCITY_ZERO_THRESHOLD) {
+		return 0;
+	}
+	int16_t units = (int16_t)std::round(table.getUnits(v));
+	return inverse ? -units : units;
+}
+
 inline
 double Robot::saturate(double v, double max_value, double zero_threshold)
 {
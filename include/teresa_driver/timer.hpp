@@ -28,6 +28,9 @@
 #define _TIMER_HPP_
 
 #include <chrono>
+#include <ctime>
+#include <errno.h>
+#include <stdint.h>
 
 namespace utils
 {
@@ -58,6 +61,134 @@ private:
   
 };
 
+/**
+ * Get the current CLOCK_MONOTONIC time in seconds
+ *
+ * It is not affected by wall-clock jumps, so use it for time intervals
+ */
+inline
+double monotonicNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**
+ * What to do when a cycle ends after its deadline
+ */
+enum OverrunPolicy
+{
+    OVERRUN_SKIP,    // Drop the missed deadlines and wait for the next one in phase
+    OVERRUN_COMPRESS // Keep the missed deadlines and run them back to back
+};
+
+/**
+ * A drift-free periodic timer
+ *
+ * The deadlines are absolute (start + k*period) in CLOCK_MONOTONIC and the
+ * thread sleeps with clock_nanosleep(TIMER_ABSTIME), so the time spent in a
+ * cycle never shifts the phase of the next ones.
+ */
+class PeriodicTimer
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param period the period in seconds
+     * @param policy what to do on overruns
+     * @param max_backlog maximum number of missed deadlines kept with OVERRUN_COMPRESS
+     */
+    PeriodicTimer(double period, OverrunPolicy policy = OVERRUN_SKIP, int max_backlog = 3)
+    : period_ns((int64_t)(period*1e9)), policy(policy), max_backlog(max_backlog),
+      overrun_counter(0), missed_counter(0), lateness(0) { start(); }
+    /**
+     * Set the phase of the deadlines to the current time
+     */
+    void start() { deadline_ns = now() + period_ns; }
+    /**
+     * Change the period, the next deadline is kept
+     *
+     * @param period the new period in seconds
+     */
+    void setPeriod(double period) { period_ns = (int64_t)(period*1e9); }
+    /**
+     * Get the period in seconds
+     */
+    double getPeriod() const { return (double)period_ns * 1e-9; }
+    /**
+     * Sleep until the next deadline
+     *
+     * @return false if the deadline was already missed (overrun), true otherwise
+     */
+    bool sleep();
+    /**
+     * Seconds left to the next deadline (negative if it was missed)
+     */
+    double remaining() const { return (double)(deadline_ns - now()) * 1e-9; }
+    /**
+     * Number of cycles that ended after their deadline
+     */
+    unsigned long overruns() const { return overrun_counter; }
+    /**
+     * Number of deadlines dropped by the overrun policy
+     */
+    unsigned long missed() const { return missed_counter; }
+    /**
+     * Seconds between the last deadline and the wake up
+     */
+    double getLateness() const { return lateness; }
+
+private:
+    static int64_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+    int64_t period_ns;
+    int64_t deadline_ns;
+    OverrunPolicy policy;
+    int max_backlog;
+    unsigned long overrun_counter;
+    unsigned long missed_counter;
+    double lateness;
+};
+
+inline
+bool PeriodicTimer::sleep()
+{
+    bool in_time = true;
+    int64_t t = now();
+    if (t > deadline_ns) { // Overrun
+        in_time = false;
+        overrun_counter++;
+        int64_t behind = (t - deadline_ns) / period_ns; // Deadlines missed after the current one
+        if (policy == OVERRUN_SKIP) {
+            // Stay in phase: drop the missed deadlines and wait for the first one after now
+            deadline_ns += (behind + 1) * period_ns;
+            missed_counter += behind + 1;
+        } else {
+            // Run the missed deadlines back to back, but no more than max_backlog of them
+            if (behind > max_backlog) {
+                deadline_ns += (behind - max_backlog) * period_ns;
+                missed_counter += behind - max_backlog;
+            }
+            lateness = (double)(t - deadline_ns) * 1e-9;
+            deadline_ns += period_ns;
+            return false;
+        }
+    }
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000LL;
+    ts.tv_nsec = deadline_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL) == EINTR) {}
+    lateness = (double)(now() - deadline_ns) * 1e-9;
+    deadline_ns += period_ns;
+    return in_time;
+}
+
 
 
 }
@@ -0,0 +1,157 @@
+/***********************************************************************/
+/**                                                                    */
+/** velocity_estimator.hpp                                             */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+#ifndef _VELOCITY_ESTIMATOR_HPP_
+#define _VELOCITY_ESTIMATOR_HPP_
+
+namespace utils
+{
+
+/**
+ * Constant-acceleration Kalman filter estimating a velocity from quantized positions
+ *
+ * The state is [position, velocity, acceleration] and the acceleration is driven
+ * by white jerk noise. Every measurement is a position (i.e. the cumulative distance
+ * of a wheel) with a uniform quantization error.
+ */
+class VelocityEstimator
+{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param jerk standard deviation of the jerk in units/s^3, higher values track changes faster
+	 * @param resolution quantization step of the positions in units
+	 */
+	VelocityEstimator(double jerk = 5.0, double resolution = 1.0) {configure(jerk,resolution);}
+	/**
+	 * Set the noise parameters and reset the filter
+	 *
+	 * @param jerk standard deviation of the jerk in units/s^3
+	 * @param resolution quantization step of the positions in units
+	 */
+	void configure(double jerk, double resolution)
+	{
+		q = jerk * jerk;
+		r = resolution * resolution / 12.0; // Variance of a uniform quantization error
+		reset();
+	}
+	/**
+	 * Forget the state, the next measurement initializes it
+	 */
+	void reset() {initialized = false; x[0] = x[1] = x[2] = 0;}
+	/**
+	 * Update the estimation with a new position
+	 *
+	 * @param position the measured position
+	 * @param time the time of the measurement in seconds
+	 */
+	void update(double position, double time);
+	/**
+	 * Estimated velocity in units/s
+	 */
+	double getVelocity() const {return x[1];}
+	/**
+	 * Estimated acceleration in units/s^2
+	 */
+	double getAcceleration() const {return x[2];}
+
+private:
+	double x[3]; // State
+	double P[3][3]; // State covariance
+	double q; // Jerk power spectral density
+	double r; // Measurement variance
+	double last_time;
+	bool initialized;
+};
+
+inline
+void VelocityEstimator::update(double position, double time)
+{
+	if (!initialized) {
+		x[0] = position;
+		x[1] = 0;
+		x[2] = 0;
+		for (int i=0;i<3;i++) {
+			for (int j=0;j<3;j++) {
+				P[i][j] = 0;
+			}
+		}
+		P[0][0] = r;
+		P[1][1] = 1.0;
+		P[2][2] = 1.0;
+		last_time = time;
+		initialized = true;
+		return;
+	}
+	double dt = time - last_time;
+	if (dt <= 0) {
+		return;
+	}
+	last_time = time;
+	// Prediction: x = F x, P = F P F' + Q
+	double F[3][3] = {{1, dt, dt*dt/2}, {0, 1, dt}, {0, 0, 1}};
+	double dt2 = dt*dt, dt3 = dt2*dt;
+	double Q[3][3] = {{q*dt3*dt2/20, q*dt2*dt2/8, q*dt3/6},
+			{q*dt2*dt2/8, q*dt3/3, q*dt2/2},
+			{q*dt3/6, q*dt2/2, q*dt}};
+	double xp[3], FP[3][3];
+	for (int i=0;i<3;i++) {
+		xp[i] = 0;
+		for (int k=0;k<3;k++) {
+			xp[i] += F[i][k] * x[k];
+		}
+		for (int j=0;j<3;j++) {
+			FP[i][j] = 0;
+			for (int k=0;k<3;k++) {
+				FP[i][j] += F[i][k] * P[k][j];
+			}
+		}
+	}
+	for (int i=0;i<3;i++) {
+		x[i] = xp[i];
+		for (int j=0;j<3;j++) {
+			P[i][j] = Q[i][j];
+			for (int k=0;k<3;k++) {
+				P[i][j] += FP[i][k] * F[j][k];
+			}
+		}
+	}
+	// Correction with the position measurement (H = [1 0 0])
+	double S = P[0][0] + r;
+	double K[3] = {P[0][0]/S, P[1][0]/S, P[2][0]/S};
+	double y = position - x[0];
+	double P0[3] = {P[0][0], P[0][1], P[0][2]};
+	for (int i=0;i<3;i++) {
+		x[i] += K[i] * y;
+		for (int j=0;j<3;j++) {
+			P[i][j] -= K[i] * P0[j];
+		}
+	}
+}
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+/***********************************************************************/
+/**                                                                    */
+/** velocity_trajectory.hpp                                            */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+
+#ifndef _VELOCITY_TRAJECTORY_HPP_
+#define _VELOCITY_TRAJECTORY_HPP_
+
+#include <vector>
+#include <limits>
+
+namespace utils
+{
+
+/**
+ * A velocity command scheduled at a given time
+ */
+struct VelocitySetpoint
+{
+	double time; // CLOCK_MONOTONIC time in seconds
+	double linear; // m/s
+	double angular; // rad/s
+};
+
+/**
+ * A queue of timed velocity setpoints, replaced as a whole
+ *
+ * The new trajectory is filled in a back buffer and swapped in by commit(),
+ * so the consumer always sees a complete trajectory and the buffers are reused
+ * without allocating once they have grown. It is not thread-safe, commit(),
+ * clear() and pop() should be protected by the caller.
+ */
+class TrajectoryQueue
+{
+public:
+	TrajectoryQueue() : next(0), skipped(0) {}
+	/**
+	 * Reserve memory for both buffers
+	 *
+	 * @param capacity number of setpoints
+	 */
+	void reserve(int capacity) {setpoints.reserve(capacity); pending.reserve(capacity);}
+	/**
+	 * Get the back buffer, empty, to fill the next trajectory
+	 *
+	 * Only the producer should use it, the setpoints should be in time order
+	 */
+	std::vector<VelocitySetpoint>& prepare() {pending.clear(); return pending;}
+	/**
+	 * Replace the current trajectory by the back buffer
+	 */
+	void commit() {setpoints.swap(pending); next=0;}
+	/**
+	 * Drop the current trajectory
+	 */
+	void clear() {setpoints.clear(); next=0;}
+	/**
+	 * Get the setpoint due at a given time
+	 *
+	 * When several setpoints are due, the older ones are skipped
+	 * @param now CLOCK_MONOTONIC time in seconds
+	 * @param setpoint[OUT] the due setpoint
+	 * @return true if there is a due setpoint, false otherwise
+	 */
+	bool pop(double now, VelocitySetpoint& setpoint);
+	/**
+	 * Time of the next setpoint, infinity if there is none
+	 */
+	double getNextTime() const
+	{
+		return next < setpoints.size() ? setpoints[next].time : std::numeric_limits<double>::infinity();
+	}
+	/**
+	 * Is there any setpoint left?
+	 */
+	bool isEmpty() const {return next >= setpoints.size();}
+	/**
+	 * Number of setpoints skipped because they were sent late
+	 */
+	unsigned long getSkipped() const {return skipped;}
+
+private:
+	std::vector<VelocitySetpoint> setpoints;
+	std::vector<VelocitySetpoint> pending;
+	unsigned next; // Index of the next setpoint
+	unsigned long skipped;
+};
+
+inline
+bool TrajectoryQueue::pop(double now, VelocitySetpoint& setpoint)
+{
+	if (next >= setpoints.size() || setpoints[next].time > now) {
+		return false;
+	}
+	while (next+1 < setpoints.size() && setpoints[next+1].time <= now) {
+		next++;
+		skipped++;
+	}
+	setpoint = setpoints[next++];
+	return true;
+}
+
+}
+
+#endif
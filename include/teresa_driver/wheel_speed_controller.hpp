@@ -0,0 +1,110 @@
+/***********************************************************************/
+/**                                                                    */
+/** wheel_speed_controller.hpp                                         */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+
+#ifndef _WHEEL_SPEED_CONTROLLER_HPP_
+#define _WHEEL_SPEED_CONTROLLER_HPP_
+
+#include <cmath>
+#include <algorithm>
+
+namespace utils
+{
+
+/**
+ * PI speed controller of a wheel with feedforward
+ *
+ * The output is feedforward + kp*error + ki*integral(error), saturated to
+ * [-max_output,max_output]. The integral is frozen while the output is
+ * saturated in the direction of the error, so it does not wind up.
+ */
+class WheelSpeedController
+{
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param kp proportional gain in output units per m/s
+	 * @param ki integral gain in output units per m
+	 * @param max_output the output saturation
+	 */
+	WheelSpeedController(double kp = 0, double ki = 0, double max_output = 100)
+	: kp(kp), ki(ki), max_output(max_output), integral(0), error(0) {}
+	/**
+	 * Set the gains
+	 *
+	 * @param kp proportional gain in output units per m/s
+	 * @param ki integral gain in output units per m
+	 * @param max_output the output saturation
+	 */
+	void setGains(double kp, double ki, double max_output)
+	{
+		WheelSpeedController::kp = kp;
+		WheelSpeedController::ki = ki;
+		WheelSpeedController::max_output = std::abs(max_output);
+	}
+	/**
+	 * Clear the integral and the error
+	 */
+	void reset() {integral = 0; error = 0;}
+	/**
+	 * Compute the output for a new speed measure
+	 *
+	 * @param reference the commanded speed in m/s
+	 * @param velocity the measured speed in m/s
+	 * @param feedforward the open-loop output for the reference
+	 * @param dt seconds since the last update
+	 * @return the saturated output
+	 */
+	double update(double reference, double velocity, double feedforward, double dt);
+	/**
+	 * Last tracking error (reference - velocity) in m/s
+	 */
+	double getError() const {return error;}
+
+private:
+	double kp;
+	double ki;
+	double max_output;
+	double integral; // In m
+	double error; // In m/s
+};
+
+inline
+double WheelSpeedController::update(double reference, double velocity, double feedforward, double dt)
+{
+	error = reference - velocity;
+	double output = feedforward + kp*error + ki*(integral + error*dt);
+	if ((output > max_output && error > 0) || (output < -max_output && error < 0)) {
+		output = feedforward + kp*error + ki*integral; // Saturated, do not integrate
+	} else {
+		integral += error*dt;
+	}
+	return std::min(std::max(output,-max_output),max_output);
+}
+
+}
+
+#endif
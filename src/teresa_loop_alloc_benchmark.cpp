@@ -0,0 +1,195 @@
+/***********************************************************************/
+/**                                                                    */
+/** teresa_loop_alloc_benchmark.cpp                                    */
+/**                                                                    */
+/** Copyright (c) 2016, Service Robotics Lab.                          */ 
+/**                     http://robotics.upo.es                         */
+/**                                                                    */
+/** All rights reserved.                                               */
+/**                                                                    */
+/** Authors:                                                           */
+/** Ignacio Perez-Hurtado (maintainer)                                 */
+/** Noe Perez                                                          */
+/** Rafael Ramon                                                       */
+/** David Alejo Teissière                                              */
+/** Fernando Caballero                                                 */
+/** Jesus Capitan                                                      */
+/** Luis Merino                                                        */
+/**                                                                    */   
+/** This software may be modified and distributed under the terms      */
+/** of the BSD license. See the LICENSE file for details.              */
+/**                                                                    */
+/** http://www.opensource.org/licenses/BSD-3-Clause                    */
+/**                                                                    */
+/***********************************************************************/
+
+
+// Heap allocations per main loop cycle of the odometry and TF publication, with the
+// messages built in every cycle (as the main loop did before) and with the reused
+// messages and the batched TF broadcast of the node. Only the allocations of the
+// thread running the cycles are counted, not the ones of the ROS threads.
+
+#include <ros/ros.h>
+#include <tf/transform_broadcaster.h>
+#include <nav_msgs/Odometry.h>
+#include <geometry_msgs/TransformStamped.h>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+static __thread bool counting = false; // Count the allocations of this thread?
+static __thread unsigned long allocations = 0;
+
+void* operator new(std::size_t size)
+{
+	if (counting) {
+		allocations++;
+	}
+	void *p = std::malloc(size == 0 ? 1 : size);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) throw()
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+	std::free(p);
+}
+
+// The frames and values of the main loop
+struct Frames
+{
+	std::string base_frame_id;
+	std::string odom_frame_id;
+	std::string stalk_frame_id;
+	std::string head_frame_id;
+};
+
+// A cycle building every message, as the main loop did before reusing them
+static void perCycleMessages(const Frames& frames, tf::TransformBroadcaster& tf_broadcaster,
+				ros::Publisher& odom_pub, double value)
+{
+	ros::Time current_time = ros::Time::now();
+	geometry_msgs::TransformStamped odom_trans;
+	odom_trans.header.stamp = current_time;
+	odom_trans.header.frame_id = frames.odom_frame_id;
+	odom_trans.child_frame_id = frames.base_frame_id;
+	odom_trans.transform.translation.x = value;
+	odom_trans.transform.translation.y = value;
+	odom_trans.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, value);
+	tf_broadcaster.sendTransform(odom_trans);
+	geometry_msgs::TransformStamped stalk_trans;
+	stalk_trans.header.stamp = current_time;
+	stalk_trans.header.frame_id = frames.base_frame_id;
+	stalk_trans.child_frame_id = frames.stalk_frame_id;
+	stalk_trans.transform.translation.z = value;
+	stalk_trans.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, 0.0);
+	tf_broadcaster.sendTransform(stalk_trans);
+	geometry_msgs::TransformStamped head_trans;
+	head_trans.header.stamp = current_time;
+	head_trans.header.frame_id = frames.stalk_frame_id;
+	head_trans.child_frame_id = frames.head_frame_id;
+	head_trans.transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, -value, 0.0);
+	tf_broadcaster.sendTransform(head_trans);
+	nav_msgs::Odometry odom;
+	odom.header.stamp = current_time;
+	odom.header.frame_id = frames.odom_frame_id;
+	odom.child_frame_id = frames.base_frame_id;
+	odom.pose.pose.position.x = value;
+	odom.pose.pose.position.y = value;
+	odom.pose.pose.orientation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, value);
+	odom.twist.twist.linear.x = value;
+	odom.twist.twist.angular.z = value;
+	odom_pub.publish(odom);
+}
+
+// A cycle with the messages reused and a single TF broadcast, as the main loop does now
+static void reusedMessages(std::vector<geometry_msgs::TransformStamped>& transforms, nav_msgs::Odometry& odom,
+				tf::TransformBroadcaster& tf_broadcaster, ros::Publisher& odom_pub, double value)
+{
+	ros::Time current_time = ros::Time::now();
+	transforms[0].header.stamp = current_time;
+	transforms[0].transform.translation.x = value;
+	transforms[0].transform.translation.y = value;
+	transforms[0].transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, value);
+	transforms[1].header.stamp = current_time;
+	transforms[1].transform.translation.z = value;
+	transforms[2].header.stamp = current_time;
+	transforms[2].transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, -value, 0.0);
+	tf_broadcaster.sendTransform(transforms);
+	odom.header.stamp = current_time;
+	odom.pose.pose.position.x = value;
+	odom.pose.pose.position.y = value;
+	odom.pose.pose.orientation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, value);
+	odom.twist.twist.linear.x = value;
+	odom.twist.twist.angular.z = value;
+	odom_pub.publish(odom);
+}
+
+int main(int argc, char** argv)
+{
+	ros::init(argc, argv, "teresa_loop_alloc_benchmark");
+	ros::NodeHandle n;
+	ros::NodeHandle pn("~");
+	int cycles;
+	Frames frames;
+	pn.param<int>("cycles",cycles,1000);
+	pn.param<std::string>("base_frame_id", frames.base_frame_id, "/base_link");
+	pn.param<std::string>("odom_frame_id", frames.odom_frame_id, "/odom");
+	pn.param<std::string>("head_frame_id", frames.head_frame_id, "/teresa_head");
+	pn.param<std::string>("stalk_frame_id", frames.stalk_frame_id, "/teresa_stalk");
+	if (cycles <= 0) {
+		ROS_FATAL("The number of cycles should be positive");
+		return 1;
+	}
+	ros::Publisher odom_pub = pn.advertise<nav_msgs::Odometry>(frames.odom_frame_id, 5);
+	tf::TransformBroadcaster tf_broadcaster;
+
+	// Set up once, as Node::initMessages()
+	std::vector<geometry_msgs::TransformStamped> transforms(3);
+	transforms[0].header.frame_id = frames.odom_frame_id;
+	transforms[0].child_frame_id = frames.base_frame_id;
+	transforms[1].header.frame_id = frames.base_frame_id;
+	transforms[1].child_frame_id = frames.stalk_frame_id;
+	transforms[1].transform.rotation = tf::createQuaternionMsgFromRollPitchYaw(0.0, 0.0, 0.0);
+	transforms[2].header.frame_id = frames.stalk_frame_id;
+	transforms[2].child_frame_id = frames.head_frame_id;
+	nav_msgs::Odometry odom;
+	odom.header.frame_id = frames.odom_frame_id;
+	odom.child_frame_id = frames.base_frame_id;
+
+	// A first cycle of each kind, so the lazy initialization of ROS is not counted
+	perCycleMessages(frames,tf_broadcaster,odom_pub,0);
+	reusedMessages(transforms,odom,tf_broadcaster,odom_pub,0);
+
+	counting = true;
+	allocations = 0;
+	for (int i=0;i<cycles;i++) {
+		perCycleMessages(frames,tf_broadcaster,odom_pub,i*0.001);
+	}
+	unsigned long before = allocations;
+	allocations = 0;
+	for (int i=0;i<cycles;i++) {
+		reusedMessages(transforms,odom,tf_broadcaster,odom_pub,i*0.001);
+	}
+	unsigned long after = allocations;
+	counting = false;
+
+	ROS_INFO("Allocations per cycle with %d cycles and %d subscribers of %s",
+		cycles,(int)odom_pub.getNumSubscribers(),frames.odom_frame_id.c_str());
+	ROS_INFO("  messages built in every cycle: %.2f",(double)before/cycles);
+	ROS_INFO("  reused messages and batched TF: %.2f",(double)after/cycles);
+	return 0;
+}
@@ -28,6 +28,7 @@
 #include <geometry_msgs/Twist.h>
 #include <sensor_msgs/Joy.h>
 #include <teresa_driver/Stalk.h>
+#include <teresa_driver/EmergencyStop.h>
 
 /////////////////////////////////
 
@@ -70,14 +71,32 @@ double currentAngularVelocity = 0;
 
 bool publishCmdVel = false;
 bool panic         = false;
+bool emergencyStop = false; // Latched in the driver until the robot is moved again
 
 ros::Publisher *stalk_pub_ptr=NULL;
+ros::Publisher *estop_pub_ptr=NULL;
+
+// Latch or clear the emergency stop of the driver
+void sendEmergencyStop(bool stop, const ros::Time& stamp)
+{
+	emergencyStop = stop;
+	if (estop_pub_ptr!=NULL) {
+		teresa_driver::EmergencyStop estop;
+		estop.header.stamp = stamp;
+		estop.stop = stop;
+		estop_pub_ptr->publish(estop);
+	}
+}
 
 // Joystick call back function
 void joyReceived(const sensor_msgs::Joy::ConstPtr& joy)
 {
 	bool prev_panic = panic;
 	panic = joy->buttons[panicButton]==1;
+
+	if (!prev_panic && panic) { // Stop the wheels through the driver fast path
+		sendEmergencyStop(true,joy->header.stamp);
+	}
 	
 	if (!prev_panic && panic && stalk_pub_ptr!=NULL) {
 		teresa_driver::Stalk stalk;
@@ -95,6 +114,10 @@ void joyReceived(const sensor_msgs::Joy::ConstPtr& joy)
 	}
 
 	publishCmdVel = joy->buttons[movePrimaryButton]==1 || joy->buttons[moveSecundaryButton]==1;
+
+	if (publishCmdVel && emergencyStop) { // Moving again after the panic button is released
+		sendEmergencyStop(false,joy->header.stamp);
+	}
 	
 	double multiplier = (joy->buttons[maxVelocityButton]==0)?0.5:1.0;
 	currentAngularVelocity = maxAngularVelocity*multiplier*joy->axes[angularVelocityAxis];
@@ -177,6 +200,8 @@ int main(int argc, char** argv)
 	ros::Publisher vel_pub = pn.advertise<geometry_msgs::Twist>(cmd_vel_id, 1);
 	ros::Publisher stalk_pub = pn.advertise<teresa_driver::Stalk>("/stalk",1);
 	stalk_pub_ptr = &stalk_pub;
+	ros::Publisher estop_pub = n.advertise<teresa_driver::EmergencyStop>("/emergency_stop",5);
+	estop_pub_ptr = &estop_pub;
 	ros::Subscriber joy_sub = n.subscribe<sensor_msgs::Joy>("/joy", 5, joyReceived);		
 
 	ros::Rate rate(freq); // normal frequency